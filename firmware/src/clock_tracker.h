@@ -0,0 +1,98 @@
+/**
+ * Clock Tracker
+ * Second-order digital PLL following an external clock. Edges arrive as
+ * audio frame timestamps; the tracker keeps a smoothed estimate of the
+ * pulse period and of where each pulse falls, so steps can be scheduled
+ * ahead on the predicted grid instead of jittering with the input.
+ */
+
+#ifndef CLOCK_TRACKER_H
+#define CLOCK_TRACKER_H
+
+#include <Arduino.h>
+
+#define CLOCK_PHASE_SHIFT 2   // Phase gain: 1/4 of each timing error
+#define CLOCK_PERIOD_SHIFT 5  // Period gain: 1/32 of each timing error
+#define CLOCK_LOST_PERIODS 3  // Missing pulses before the lock is dropped
+
+class ClockTracker {
+ public:
+  // Accept pulse periods between minFrames and maxFrames
+  ClockTracker(uint32_t minFrames, uint32_t maxFrames)
+      : minPeriodQ16((uint64_t)minFrames << 16),
+        maxPeriodQ16((uint64_t)maxFrames << 16) {}
+
+  // Feed one clock edge. Returns true while the tracker is locked.
+  bool edge(uint64_t frame) {
+    int64_t frameQ16 = (int64_t)(frame << 16);
+
+    if (!isLocked) {
+      // Two edges a plausible period apart give the first estimate
+      int64_t interval = frameQ16 - lastEdgeQ16;
+      bool plausible = haveEdge && interval >= (int64_t)minPeriodQ16 &&
+                       interval <= (int64_t)maxPeriodQ16;
+      lastEdgeQ16 = frameQ16;
+      haveEdge = true;
+      if (!plausible) return false;
+
+      periodQ16 = interval;
+      phaseQ16 = frameQ16;
+      pulseIndex++;
+      isLocked = true;
+      locks++;
+      return true;
+    }
+
+    int64_t predicted = phaseQ16 + periodQ16;
+    int64_t error = frameQ16 - predicted;
+    lastEdgeQ16 = frameQ16;
+
+    // An edge nowhere near the prediction means a skipped pulse or a jump
+    // in tempo: start measuring again from this edge
+    if (error > periodQ16 / 2 || error < -periodQ16 / 2) {
+      isLocked = false;
+      return false;
+    }
+
+    phaseQ16 = predicted + (error >> CLOCK_PHASE_SHIFT);
+    periodQ16 += error >> CLOCK_PERIOD_SHIFT;
+    periodQ16 = constrain(periodQ16, (int64_t)minPeriodQ16,
+                          (int64_t)maxPeriodQ16);
+    pulseIndex++;
+    lastErrorQ16 = error;
+    return true;
+  }
+
+  // Drop the lock once the clock has stopped
+  void checkTimeout(uint64_t frame) {
+    if (isLocked &&
+        (int64_t)(frame << 16) > phaseQ16 + CLOCK_LOST_PERIODS * periodQ16) {
+      isLocked = false;
+      haveEdge = false;
+    }
+  }
+
+  bool locked() const { return isLocked; }
+
+  // Count of pulses followed; phase() is the estimate for this one
+  uint32_t pulse() const { return pulseIndex; }
+  uint64_t phase() const { return phaseQ16; }    // Frame, Q16
+  uint64_t period() const { return periodQ16; }  // Frames per pulse, Q16
+
+  int32_t lastErrorFrames() const { return (int32_t)(lastErrorQ16 >> 16); }
+  uint32_t lockCount() const { return locks; }
+
+ private:
+  int64_t minPeriodQ16;
+  int64_t maxPeriodQ16;
+  int64_t lastEdgeQ16 = 0;
+  int64_t phaseQ16 = 0;
+  int64_t periodQ16 = 0;
+  int64_t lastErrorQ16 = 0;
+  uint32_t pulseIndex = 0;
+  uint32_t locks = 0;
+  bool haveEdge = false;
+  bool isLocked = false;
+};
+
+#endif  // CLOCK_TRACKER_H
@@ -0,0 +1,42 @@
+/**
+ * Engine Configuration
+ * Compile-time shape of the audio engine: sample rate, block size, voice
+ * count and stream ring size. Every value is checked when the firmware is
+ * built, loops over voices and frames have constant bounds, and the rings
+ * are powers of two so wrapping is a mask.
+ */
+
+#ifndef ENGINE_CONFIG_H
+#define ENGINE_CONFIG_H
+
+#include <Arduino.h>
+
+template <uint32_t SampleRate, int BlockFrames, int Voices, int RingSamples>
+struct EngineConfig {
+  static constexpr uint32_t sampleRate = SampleRate;
+  static constexpr int blockFrames = BlockFrames;  // Frames per loop() pass
+  static constexpr int voices = Voices;  // Hits mixed at once, all channels
+  static constexpr int ringSamples = RingSamples;  // Stream ring per voice
+  static constexpr int channels = 4;  // One per trigger jack, fixed
+
+  static_assert(SampleRate >= 8000 && SampleRate <= 96000,
+                "Sample rate outside what the I2S output supports");
+  static_assert(BlockFrames >= 8 && BlockFrames <= 256 &&
+                    (BlockFrames & (BlockFrames - 1)) == 0,
+                "Block size must be a power of two from 8 to 256 frames");
+  static_assert(Voices >= 1 && Voices <= 32,
+                "Active voices are tracked in a 32-bit mask");
+  static_assert(RingSamples >= 256 && (RingSamples & (RingSamples - 1)) == 0,
+                "Stream rings must be a power of two of at least 256");
+  static_assert(RingSamples >= 4 * BlockFrames,
+                "Stream rings must hold several blocks");
+};
+
+// 4 voices in 16-frame blocks: a third of a millisecond from trigger to
+// mix, for tight single-hit playing
+using LowLatencyEngine = EngineConfig<48000, 16, 4, 1024>;
+
+// 8 voices in 32-frame blocks, so ratchets and tails can overlap
+using HighCapacityEngine = EngineConfig<48000, 32, 8, 1024>;
+
+#endif  // ENGINE_CONFIG_H
@@ -2,13 +2,28 @@
  * Eurorack Drum Machine - Flash Streaming Version
  *
  * Features:
- * - 4-voice polyphonic sample playback with flash streaming
- * - Samples stored in flash filesystem (1MB available)
- * - Small RAM buffers for streaming (2KB per voice)
+ * - 8-voice polyphonic sample playback with flash streaming, voices
+ *   shared by all channels so repeated hits overlap
+ * - Samples stored contiguously in a raw 1MB flash region, read through
+ *   XIP, with gaps from replaced samples compacted in the background
+ * - Small RAM buffers for streaming (2KB blocks leased from a static pool)
  * - Much longer samples supported (up to 5+ seconds each)
  * - SD card → Flash → Streaming playback workflow
- * - OLED display with sample status and navigation
+ * - Last kit restored from flash at boot, SD scanned in the background
+ * - OLED display with sample status, a waveform overview of the loaded
+ *   sample and navigation, changed pages sent
+ *   over I2C by DMA so drawing never blocks audio
+ * - Rotary encoder browsing, decoded by PIO with acceleration
+ * - Internal 4-track step sequencer, scheduled on the audio frame clock
+ *   and phase-locked to an external clock input when one is patched
+ * - Ratchets: steps and jack triggers rolled into 2-8 hits per step,
+ *   scheduled in audio frames
+ * - Per-voice and master level meters with a clip count
  * - Button triggers for manual playback
+ * - Optional CV input setting each hit's velocity or picking its sample
+ *   from a folder bank imported to flash
+ * - Up to 4 variants per channel, picked by velocity layer or round-robin,
+ *   with their attack heads held in RAM
  * - I2S audio output via PCM5102A
  */
 
@@ -20,6 +35,24 @@
 #include <SD.h>
 #include <SPI.h>
 #include <Wire.h>
+#include <hardware/adc.h>
+#include <hardware/dma.h>
+#include <hardware/gpio.h>
+#include <hardware/pio.h>
+#include <hardware/sync.h>
+#include <hardware/timer.h>
+
+#include "clock_tracker.h"
+#include "engine_config.h"
+#include "oled_push.h"
+#include "sample_index.h"
+#include "sample_region.h"
+#include "spsc_ring.h"
+#include "step_sequencer.h"
+#include "stream_pool.h"
+#include "waveform_overview.h"
+#include "quadrature_encoder.pio.h"
+#include "trigger_capture.pio.h"
 
 // I2S pin definitions - SAME AS WORKING CODE
 #define I2S_BCK_PIN 26   // Bit clock
@@ -31,6 +64,11 @@
 #define SCREEN_HEIGHT 32
 #define OLED_RESET -1
 #define SCREEN_ADDRESS 0x3C
+#define OLED_I2C_HZ 1000000  // Fast-mode Plus once the panel is set up
+#define DISPLAY_FRAME_MS 33  // Redraws coalesced to at most ~30 per second
+#define METER_DECAY_MS 30     // Control-rate meter fall: 1/4 per step
+#define METER_HEIGHT 24       // Bar height in pixels, ~1.5dB each
+#define METER_CLIP_HOLD_MS 1000  // How long CLIP stays lit after a clip
 
 // I2C pins for OLED
 #define SDA_PIN 4  // GPIO4 for I2C SDA
@@ -51,94 +89,459 @@
 // Navigation buttons
 #define NAV_UP_PIN 10      // GPIO10 - Navigate up
 #define NAV_DOWN_PIN 11    // GPIO11 - Navigate down
-#define NAV_SELECT_PIN 12  // GPIO12 - Select sample
+#define NAV_SELECT_PIN 12  // GPIO12 - Select sample (and encoder push)
+
+// CV input jack. ADC0-2 share GPIO26-28 with I2S and a stock Pico reads
+// VSYS/3 on ADC3, so only builds for boards that route the jack to GPIO29
+// should give it a role (-DCV_INPUT_MODE=1 or 2).
+#define CV_INPUT_NONE 0
+#define CV_INPUT_ACCENT 1  // Level at each trigger sets its velocity
+#define CV_INPUT_SAMPLE 2  // Level at each trigger picks a bank sample
+#ifndef CV_INPUT_MODE
+#define CV_INPUT_MODE CV_INPUT_NONE
+#endif
+#define CV_ADC_PIN 29  // GPIO29 - ADC3
+#define CV_ADC_INPUT 3
+
+// External clock input (active low like the triggers)
+#define CLOCK_IN_PIN 15  // GPIO15 - Clock
+
+// Rotary encoder (PEC11R) quadrature outputs
+#define ENCODER_A_PIN 13  // GPIO13 - Encoder A
+#define ENCODER_B_PIN 14  // GPIO14 - Encoder B
+
+// Audio engine shape, fixed at compile time (48kHz to match the samples).
+// Build with -DENGINE_LOW_LATENCY for 4 voices in 16-frame blocks, or
+// -DVOICE_COUNT=n for the default blocks with n voices.
+#ifdef ENGINE_LOW_LATENCY
+using Engine = LowLatencyEngine;
+#elif defined(VOICE_COUNT)
+using Engine = EngineConfig<48000, 32, VOICE_COUNT, 1024>;
+#else
+using Engine = HighCapacityEngine;
+#endif
 
 // Audio parameters
-#define SAMPLE_RATE 48000        // Match your 48kHz samples
-#define DEBOUNCE_DELAY 20        // 20ms debounce delay
-#define STREAM_BUFFER_SIZE 2048  // 2KB streaming buffer per voice
-#define REFILL_THRESHOLD 512     // Refill when buffer has < 512 samples
+#define BUTTON_SCAN_MS 5         // Panel scan period; 4 stable scans = 20ms
+#define TRIGGER_HOLDOFF_US 1000  // Ignore edges within 1ms of a trigger
+#define TRIGGER_REARM_US 5000    // Input released this long before a re-hit
+#define TRIGGER_SAMPLE_RATE_HZ 1000000  // PIO trigger sampling rate (~1us)
+#define TRIGGER_RING_BYTES 256          // DMA ring of captured pin changes
+#define TRIGGER_LATENCY_BLOCKS 2        // Fixed edge-to-audio delay, in blocks
+#define CV_SAMPLE_RATE_HZ 10000  // Free-running CV ADC rate (100us)
+#define CV_RING_BYTES 512        // DMA ring of CV samples (25.6ms)
+#define CV_SETTLE_US 200         // Read the CV this long after an edge
+#define VELOCITY_UNITY 32768     // Q15 gain of a full-level hit
+#define VELOCITY_FLOOR 8192      // Q15 gain with the accent input at 0V
+#define LONG_PRESS_MS 600      // Select held this long toggles step edit
+#define SEQUENCER_VELOCITY 22938  // Q15 gain of an unaccented step (70%)
+#define RATCHET_DECAY_PERCENT 25  // Repeat level drop when decay is on
+#define CLOCK_STEPS_PER_PULSE 1  // Steps per clock pulse (4: quarter notes)
+#define CLOCK_HOLDOFF_US 1000    // Ignore clock edges within 1ms of the last
+#define CLOCK_RING_SIZE 8        // Clock edges queued by the interrupt
+#define SEQUENCER_STATE_PATH "/pattern.bin"
+#define SEQUENCER_STATE_MAGIC 0x51455350  // "PSEQ"
+#define ENCODER_MAX_STEP_RATE 100000  // Quadrature steps/s the PIO follows
+#define ENCODER_COUNTS_PER_DETENT 4   // PEC11R: one full cycle per detent
+#define ENCODER_POLL_MS 10            // Control-rate encoder read
+#define ENCODER_FAST_MS 20    // Detents closer than this move 8 samples
+#define ENCODER_MEDIUM_MS 50  // Detents closer than this move 3 samples
+#define REFILL_CHUNK_SAMPLES 256   // Max samples read per refill request
+#define REFILL_BUDGET_SAMPLES 512  // Max samples read from flash per block
+#define PLAYBACK_RATE_UNITY 65536  // Q16 consumption rate for 1:1 playback
+#define MAX_VARIANTS 4             // Samples loaded per channel
+#define ATTACK_HEAD_SAMPLES 256    // Start of each variant kept in RAM
+#define VELOCITY_LAYER_SHIFT 11    // Q15 velocity >> 11 = one of 16 slots
+#define VELOCITY_LAYER_SLOTS 16
 #define MAX_FLASH_SAMPLE_SIZE \
   524288  // 512KB max per sample (~5.5 seconds at 48kHz)
+#define FLASH_COPY_FRAMES 128  // WAV frames converted per flash copy step
+
+// Sample metadata limits
+#define MAX_NAME_LEN SAMPLE_INDEX_NAME_LEN  // Longest filename, including NUL
+#define MAX_PATH_LEN 64                     // Longest "/folder/filename" path
+#define INDEX_SYNC_FILES_PER_STEP 2         // Directory entries per loop()
+
+// Kit state persisted in flash so samples are playable straight after boot
+#define KIT_STATE_PATH "/kit.bin"
+#define KIT_STATE_TEMP_PATH "/kit.tmp"
+#define KIT_STATE_MAGIC 0x5354494B  // "KITS"
+#define KIT_STATE_VERSION 2
+
+// Folder bank: every sample of one channel's folder imported to flash
+#define BANK_MAX_SAMPLES 32  // Samples (and RAM attack heads) in the bank
+#define BANK_FLASH_DIR "/bank"
+#define BANK_STATE_PATH "/bank.bin"
+#define BANK_STATE_MAGIC 0x4B4E4142  // "BANK"
+#define BANK_STATE_VERSION 1
+
+// Raw flash the sample copies live in, just below the filesystem
+#define SAMPLE_REGION_BYTES (1024 * 1024)
+#define REGION_MAX_SAMPLES 64  // Kit variants and the bank, with room to spare
+#define REGION_STATE_PATH "/region.bin"
+#define REGION_STATE_MAGIC 0x4E474552  // "REGN"
+#define REGION_STATE_VERSION 1
+#define FLASH_IDLE_MS 2000  // Quiet time before a flash erase may stall loop()
+#define VERIFY_STEP_BYTES 4096  // Sample bytes checksummed per idle pass
+
+// One sample loaded into a channel. Its first ATTACK_HEAD_SAMPLES are kept
+// in RAM so a hit starts playing without touching flash, and where its
+// flash copy sits is kept too, so a hit never looks it up by name.
+struct SampleVariant {
+  char filename[MAX_NAME_LEN];
+  char flashPath[MAX_PATH_LEN];
+  const uint8_t* flashFile;  // Flash copy in the XIP window, nullptr if gone
+  uint32_t flashBytes;       // Length of the flash copy
+  uint32_t totalSamples;  // Total samples in flash file
+  int32_t sampleIndex;    // Position in the SD folder it was loaded from
+  uint32_t headSamples;   // Samples in head (short files fit entirely)
+  int16_t head[ATTACK_HEAD_SAMPLES];
+  WaveformOverview overview;  // Peaks for the display, flat if not stored
+};
+
+// How a channel picks a variant for each hit
+enum VariantMode : uint8_t { VARIANT_VELOCITY, VARIANT_ROUND_ROBIN };
 
-// Flash-based streaming sample buffer
+// One playing hit's cold state: the flash stream feeding it and its
+// bookkeeping. What the mixer reads every frame is in VoiceMixState.
 struct StreamingSample {
-  int16_t* buffer;           // Small RAM buffer for streaming
-  uint32_t bufferSize;       // Size of RAM buffer (in samples)
-  uint32_t bufferHead;       // Current read position in buffer
-  uint32_t bufferTail;       // Current write position in buffer
-  uint32_t samplesInBuffer;  // Number of samples currently in buffer
 
-  File flashFile;          // Open file handle for streaming
-  uint32_t totalSamples;   // Total samples in flash file
-  uint32_t samplesPlayed;  // Samples played so far
+  const int16_t* flashData;      // Next samples to stream, in the XIP window
+  uint32_t flashLeft;            // Samples still to stream
+  const SampleVariant* variant;  // Variant being played
+  uint32_t playbackRate;         // Q16 samples consumed per output frame
+  uint32_t underruns;            // Frames where the buffer ran dry mid-file
+  uint32_t startOrder;           // Hit count when started, for stealing
+  int8_t channel;                // Channel that triggered it
 
   bool playing;
-  bool loaded;
   bool endOfFile;
-  String filename;
-  String flashPath;
+};
+
+// Ring a voice streams through, over a block leased from the pool
+using StreamRing = SpscRing<int16_t, Engine::ringSamples>;
+
+// Hot playback state, one array per field, so rendering a voice walks a
+// few contiguous words instead of dragging its file handle and variant
+// metadata through memory
+struct VoiceMixState {
+  const int16_t* head[Engine::voices];  // Attack head of the variant, in RAM
+  StreamRing ring[Engine::voices];      // Samples read ahead from flash
+  uint32_t played[Engine::voices];      // Samples played so far
+  uint32_t headEnd[Engine::voices];     // Samples in the attack head
+  uint32_t remaining[Engine::voices];   // Samples left to play
+  uint32_t delay[Engine::voices];       // Silent frames before the start
+  uint16_t gain[Engine::voices];        // Q15 level from the hit's velocity
 };
 
 // Sample player structure
 struct SamplePlayer {
-  StreamingSample stream;
   const char* folderName;
   int currentSampleIndex;
   int totalSamples;
-  String sampleList[16];  // Max 16 samples per folder
+  SampleFolderIndex index;  // On-SD index of the folder's WAV files
+
+  SampleVariant variants[MAX_VARIANTS];  // Loaded softest layer first
+  int variantCount;
+  VariantMode variantMode;
+  uint8_t nextVariant;  // Round-robin position
+  uint8_t velocityLayer[VELOCITY_LAYER_SLOTS];  // Variant for each slot
 };
 
 // Initialize sample players for each drum type
-SamplePlayer samplePlayers[4] = {
-    {{nullptr, 0, 0, 0, 0, File(), 0, 0, false, false, false, "", ""},
-     "kick",
-     0,
-     0,
-     {}},
-    {{nullptr, 0, 0, 0, 0, File(), 0, 0, false, false, false, "", ""},
-     "snare",
-     0,
-     0,
-     {}},
-    {{nullptr, 0, 0, 0, 0, File(), 0, 0, false, false, false, "", ""},
-     "hihat",
-     0,
-     0,
-     {}},
-    {{nullptr, 0, 0, 0, 0, File(), 0, 0, false, false, false, "", ""},
-     "tom",
-     0,
-     0,
-     {}}};
-
-// Button state tracking
-struct ButtonState {
+SamplePlayer samplePlayers[Engine::channels] = {
+    {"kick", 0, 0, {}, {}, 0, VARIANT_VELOCITY, 0, {}},
+    {"snare", 0, 0, {}, {}, 0, VARIANT_VELOCITY, 0, {}},
+    {"hihat", 0, 0, {}, {}, 0, VARIANT_VELOCITY, 0, {}},
+    {"tom", 0, 0, {}, {}, 0, VARIANT_VELOCITY, 0, {}}};
+
+// Per-variant entry of the persisted kit
+struct KitVariantRecord {
+  char filename[MAX_NAME_LEN];
+  char flashPath[MAX_PATH_LEN];
+  int32_t sampleIndex;
+};
+
+// Per-channel entry of the persisted kit
+struct KitChannelRecord {
+  KitVariantRecord variants[MAX_VARIANTS];
+  int32_t sampleIndex;  // Folder position of the last sample loaded
+  uint8_t variantCount;
+  uint8_t variantMode;
+  uint8_t reserved[2];
+};
+
+// Kit mapping as stored at KIT_STATE_PATH
+struct KitStateRecord {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t channelCount;
+  KitChannelRecord channels[Engine::channels];
+  uint32_t checksum;  // FNV-1a over everything above
+};
+
+// A WAV being converted from SD into the sample region, one bounded step
+// at a time
+struct FlashCopy {
+  bool active;  // Started and not yet finished or abandoned
+  File sdFile;  // Positioned at the next frame to convert
+  uint16_t bitsPerSample;
+  uint16_t numChannels;
+  uint32_t totalSamples;  // 16-bit mono samples the copy holds
+  uint32_t samplesDone;   // Of those, stored so far
+  uint32_t samplesRead;   // Of those, read from SD; the rest are silence
+  OverviewBuilder peaks;
+  WaveformOverview overview;
+  char flashPath[MAX_PATH_LEN];
+};
+
+// Samples the CV input can address on the bank channel. Imported in the
+// background, FLASH_COPY_FRAMES per loop() pass; all attack heads stay in
+// RAM so any of them can start on the trigger that selects it.
+struct SampleBank {
+  int channel;     // Channel the bank plays on, -1 for none
+  int count;       // Samples imported so far
+  int importNext;  // Folder position of the import under way, -1 when idle
+  SampleVariant samples[BANK_MAX_SAMPLES];
+  FlashCopy copy;     // Import of samples[count], while active
+  bool awaitingRoom;  // Next sample waits on compaction to close the gaps
+};
+
+SampleBank sampleBank = {-1, 0, -1, {}, {}, false};
+
+// Bank contents as stored at BANK_STATE_PATH
+struct BankStateRecord {
+  uint32_t magic;
+  uint16_t version;
+  int16_t channel;
+  uint32_t count;
+  KitVariantRecord samples[BANK_MAX_SAMPLES];
+  uint32_t checksum;  // FNV-1a over everything above
+};
+
+// Where each sample sits in the region, stored at REGION_STATE_PATH
+using SampleStore = SampleRegion<REGION_MAX_SAMPLES, MAX_PATH_LEN>;
+SampleStore sampleRegion;
+
+// Last loop() pass anything was playing. Flash erases stall loop() for
+// tens of milliseconds, so the background work that needs them waits
+// until playback has been idle for FLASH_IDLE_MS.
+unsigned long lastPlayingMs = 0;
+
+// How a copy into the sample region got started
+enum CopyStart { COPY_STARTED, COPY_FAILED, COPY_NEEDS_ROOM };
+
+struct RegionStateRecord {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  SampleStore::Extent extents[REGION_MAX_SAMPLES];
+  uint32_t checksum;  // FNV-1a over everything above
+};
+
+// Flash layout from the Arduino-Pico linker script
+extern uint8_t _FS_start;
+extern uint8_t __flash_binary_end;
+
+// Persisted pattern, stored at SEQUENCER_STATE_PATH
+struct SequencerStateRecord {
+  uint32_t magic;
+  SequencerPattern pattern;
+  uint32_t checksum;  // FNV-1a over everything above
+};
+
+// Background SD scan, advanced a slice at a time from loop()
+enum ScanState { SCAN_PENDING, SCAN_FOLDERS, SCAN_DONE };
+ScanState scanState = SCAN_PENDING;
+int scanFolder = 0;
+unsigned long scanStartTime = 0;
+uint32_t scanStartHeap = 0;  // Free heap when the scan began
+
+// Voices are claimed per hit rather than owned by a channel, so a
+// channel's hits overlap instead of cutting each other off
+StreamingSample voices[Engine::voices];
+VoiceMixState voiceMix = {};
+uint32_t voiceStarts = 0;  // Hits started, stamped on each voice
+uint32_t voiceSteals = 0;  // Hits that had to cut the oldest voice
+uint32_t activeVoices = 0;  // Bit per playing voice
+uint32_t idleBlocks = 0;    // Blocks sent as silence without mixing
+
+// Mixer cost by number of voices playing, for the "b" stats. The cycle
+// totals are 64-bit: at 133MHz a 32-bit total wraps within a minute.
+uint64_t mixCycles[Engine::voices + 1];
+uint32_t mixBlocks[Engine::voices + 1];
+
+// Stream buffers are leased from a static arena on trigger
+StreamBufferPool<Engine::ringSamples, Engine::voices> streamPool;
+static_assert(REFILL_BUDGET_SAMPLES >= Engine::voices * Engine::blockFrames,
+              "Refills can't keep every voice fed at full rate");
+static_assert(Engine::ringSamples >= 2 * REFILL_CHUNK_SAMPLES,
+              "A refill chunk must fit while the ring is half full");
+
+// Repeats of a ratcheted hit still to come, timed in audio frames
+struct RatchetRoll {
+  uint64_t nextFrameQ16;  // Frame of the next repeat, Q16
+  uint64_t intervalQ16;   // Frames between repeats, Q16
+  uint16_t velocity;      // Q15 level of the next repeat
+  uint8_t remaining;      // Repeats still to play
+  int8_t bankSlot;        // Bank sample the roll's first hit picked
+};
+
+RatchetRoll ratchetRolls[Engine::channels];
+uint8_t activeRolls = 0;  // Bit per channel with repeats pending
+// Hits per jack trigger
+uint8_t triggerRatchets[Engine::channels] = {1, 1, 1, 1};
+
+// Trigger inputs: jacks and panel buttons share these pins and are
+// sampled by a PIO state machine rather than polled
+static_assert(BUTTON_2_PIN == BUTTON_1_PIN + 1 &&
+                  BUTTON_3_PIN == BUTTON_1_PIN + 2 &&
+                  BUTTON_4_PIN == BUTTON_1_PIN + 3,
+              "PIO trigger capture needs consecutive trigger pins");
+
+struct TriggerInput {
   int pin;
-  bool lastState;
-  bool currentState;
-  unsigned long lastDebounceTime;
-  bool triggered;
   const char* name;
+  uint32_t lastEdgeUs;  // Timestamp of the last accepted edge
+  uint32_t releasedUs;  // Timestamp of the last release (rising pin)
 };
 
-// Initialize button states
-ButtonState buttons[4] = {{BUTTON_1_PIN, HIGH, HIGH, 0, false, "Kick"},
-                          {BUTTON_2_PIN, HIGH, HIGH, 0, false, "Snare"},
-                          {BUTTON_3_PIN, HIGH, HIGH, 0, false, "Hihat"},
-                          {BUTTON_4_PIN, HIGH, HIGH, 0, false, "Tom"}};
+TriggerInput triggerInputs[Engine::channels] = {{BUTTON_1_PIN, "Kick", 0, 0},
+                                                 {BUTTON_2_PIN, "Snare", 0, 0},
+                                                 {BUTTON_3_PIN, "Hihat", 0, 0},
+                                                 {BUTTON_4_PIN, "Tom", 0, 0}};
+
+// Pin-change words pushed by the trigger_capture PIO program land here
+// via DMA; the ring is aligned to its size so DMA can wrap it
+uint32_t triggerRing[TRIGGER_RING_BYTES / 4]
+    __attribute__((aligned(TRIGGER_RING_BYTES)));
+int triggerDmaChannel = -1;
+uint32_t triggerRingRead = 0;        // Next ring word to decode
+uint32_t triggerPinState = 0xF;      // Last decoded snapshot (active low)
+
+// The capture counter runs at tickNum / tickDen ticks per microsecond, as
+// set by the divider actually programmed. Its position is predicted from
+// time_us_32() at an anchor carried forward every pass.
+uint64_t triggerTickNum = 1;
+uint64_t triggerTickDen = 1;
+uint32_t triggerAnchorUs = 0;         // time_us_32() of the anchor
+uint32_t triggerAnchorTicks = 0;      // Counter ticks elapsed by then
+uint64_t triggerAnchorRemainder = 0;  // Part tick elapsed, over tickDen
+
+#if CV_INPUT_MODE != CV_INPUT_NONE
+// CV ADC samples, written continuously by DMA so the level at any recent
+// trigger edge can be looked up without the trigger path waiting on a
+// conversion
+uint16_t cvRing[CV_RING_BYTES / 2] __attribute__((aligned(CV_RING_BYTES)));
+int cvDmaChannel = -1;
+#endif
 
 // Navigation buttons
-ButtonState navButtons[3] = {{NAV_UP_PIN, HIGH, HIGH, 0, false, "Up"},
-                             {NAV_DOWN_PIN, HIGH, HIGH, 0, false, "Down"},
-                             {NAV_SELECT_PIN, HIGH, HIGH, 0, false, "Select"}};
+struct NavInput {
+  int pin;
+  const char* name;
+};
+
+const NavInput navInputs[3] = {
+    {NAV_UP_PIN, "Up"}, {NAV_DOWN_PIN, "Down"}, {NAV_SELECT_PIN, "Select"}};
+
+// Panel input bits within a gpio_get_all() snapshot
+#define NAV_UP_MASK (1u << NAV_UP_PIN)
+#define NAV_DOWN_MASK (1u << NAV_DOWN_PIN)
+#define NAV_SELECT_MASK (1u << NAV_SELECT_PIN)
+#define TRIGGER_BUTTON_MASK (0xFu << BUTTON_1_PIN)
+#define PANEL_INPUT_MASK \
+  (TRIGGER_BUTTON_MASK | NAV_UP_MASK | NAV_DOWN_MASK | NAV_SELECT_MASK)
+
+// All panel buttons debounced together: each input bit has a 2-bit
+// vertical counter spread across count0/count1, and its debounced level
+// only flips after four consecutive scans disagree with it
+struct PanelButtons {
+  uint32_t state;     // Debounced levels (active low)
+  uint32_t count0;    // Vertical counter, low bit
+  uint32_t count1;    // Vertical counter, high bit
+  uint32_t pressed;   // Inputs pressed since last processed
+  uint32_t released;  // Inputs released since last processed
+};
+
+PanelButtons panelButtons = {PANEL_INPUT_MASK, 0, 0, 0, 0};
+
+// Navigation encoder: a PIO state machine keeps the running count, and
+// loop() turns the change since its last read into browse steps
+static_assert(ENCODER_B_PIN == ENCODER_A_PIN + 1,
+              "PIO quadrature decoder needs consecutive encoder pins");
+
+struct EncoderInput {
+  PIO pio;                   // nullptr if no state machine was free
+  uint sm;
+  int32_t consumedCount;     // Count already turned into browse steps
+  unsigned long lastMoveMs;  // When the last detent was seen
+};
+
+EncoderInput encoder = {nullptr, 0, 0, 0};
+
+// Sample in the current folder that select will load
+int browseSampleIndex = 0;
+char browseName[MAX_NAME_LEN] = "";
 
 // Create OLED display object
 Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
 
+// Sends the display's buffer without blocking; the library's display()
+// is only used if no DMA channel was free
+OledPush oledPush;
+uint32_t displayWorkUs = 0;      // loop() time spent on the last redraw
+uint32_t displayWorkPeakUs = 0;  // Longest redraw since boot
+
+// Peak levels: raised by the mixer as it goes, decayed at control rate
+struct LevelMeters {
+  uint32_t voicePeak[Engine::voices];
+  uint32_t masterPeak;       // Mix before the clamp, so it can pass 32767
+  uint32_t clippedSamples;   // Mixed samples the clamp flattened
+  unsigned long lastClipMs;  // When the clamp last acted
+  uint8_t shown[Engine::voices + 1];  // Bar heights as last marked for redraw
+};
+
+LevelMeters levelMeters = {};
+bool meterView = false;  // Screen shows the meters instead of the sample
+
+// Set by anything that changes what the screen shows; loop() redraws only
+// then, so an idle panel costs nothing
+bool displayDirty = true;
+uint16_t shownClockBpm = 0;  // Clock tempo as last marked for redraw
+
 // I2S output object
 I2S i2s(OUTPUT, I2S_BCK_PIN, I2S_DATA_PIN);
 
+// Audio frames written to I2S since boot: the sequencer's clock
+uint64_t audioFrame = 0;
+
+// Internal sequencer; tracks follow the channel order
+StepSequencer sequencer(Engine::sampleRate);
+bool sequencerEditing = false;  // Encoder and select edit the pattern
+int stepCursor = 0;             // Step the editor points at
+
+// Clock edges, timestamped by the GPIO interrupt and turned into audio
+// frames by loop()
+uint32_t clockEdgeUs[CLOCK_RING_SIZE];
+SpscRing<uint32_t, CLOCK_RING_SIZE> clockEdges(clockEdgeUs);
+
+// Tracks clocks between the sequencer's tempo limits
+ClockTracker clockTracker(
+    (uint32_t)((uint64_t)Engine::sampleRate * 60 * CLOCK_STEPS_PER_PULSE /
+               (SEQUENCER_MAX_BPM * SEQUENCER_STEPS_PER_BEAT)),
+    (uint32_t)((uint64_t)Engine::sampleRate * 60 * CLOCK_STEPS_PER_PULSE /
+               (SEQUENCER_MIN_BPM * SEQUENCER_STEPS_PER_BEAT)));
+bool clockSynced = false;    // Sequencer grid follows the clock
+uint32_t clockBasePulse = 0;  // Clock pulse that carries clockBaseStep
+uint32_t clockBaseStep = 0;
+
+// time_us_32() to audio frame mapping. I2S writes block until a DMA
+// buffer frees up, so the frame count seen at any instant jumps in
+// bursts; a slowly corrected linear estimate smooths that out.
+int64_t audioClockFrameQ8 = -1;  // Estimated frame at audioClockUs, Q8
+uint32_t audioClockUs = 0;
+
 // Control variables
 bool oledWorking = false;
 bool sdCardWorking = false;
@@ -148,46 +551,132 @@ int currentMenuSample = 0;
 
 // Forward declarations
 void initializeFlash();
+void saveRegionState();
+void locateVariants();
+void restoreRegionState();
+void serviceCompaction();
+bool playbackIdle();
 void initializeStreamBuffers();
 void initializeSDCard();
-void scanSampleFolders();
-void loadSampleToFlash(int playerIndex, int sampleIndex);
-void triggerSample(int sampleIndex);
-void refillStreamBuffer(int playerIndex);
-int16_t getNextSample(int playerIndex);
+void serviceSampleScan();
+void finishSampleScan();
+void saveKitState();
+bool restoreKitState();
+uint32_t kitChecksum(const KitStateRecord& record);
+uint32_t fnvChecksum(const void* data, size_t length);
+void startBankImport(int playerIndex);
+void clearSampleBank();
+void serviceBankImport();
+void startBankSample();
+void finishBankSample();
+void advanceBankImport();
+void saveBankState();
+bool restoreBankState();
+void loadSampleToFlash(int playerIndex, int sampleIndex,
+                       bool addVariant = false);
+bool loadVariantHead(SampleVariant& variant);
+void rebuildVelocityLayers(SamplePlayer& player);
+int selectVariant(SamplePlayer& player, uint16_t velocity);
+void triggerSample(int sampleIndex, uint16_t velocity = VELOCITY_UNITY,
+                   int bankSlot = -1, uint32_t startDelay = 0);
+void playHit(int sampleIndex, uint16_t velocity, int bankSlot,
+             uint32_t startDelay, int hits);
+void runRatchets();
+int allocateVoice();
+bool channelPlaying(int sampleIndex);
+void stopChannel(int sampleIndex);
+void stopStream(int voiceIndex);
+uint32_t refillStreamBuffer(int voiceIndex, uint32_t maxSamples);
+uint32_t framesUntilEmpty(int voiceIndex);
+void scheduleStreamRefills();
+void writeSilentBlock();
+uint32_t renderVoice(int voiceIndex, int32_t* mix);
+void initializeTriggerCapture();
+void advanceCaptureAnchor(uint32_t nowUs);
+uint32_t captureTimestampUs(uint32_t count);
+void initializeCvInput();
+uint16_t cvLevelAt(uint32_t edgeUs, uint32_t nowUs);
+uint16_t accentVelocityAt(uint32_t edgeUs, uint32_t nowUs);
+int bankSlotAt(uint32_t edgeUs, uint32_t nowUs);
+void initializeEncoder();
+void serviceEncoder();
+void selectMenuSample(int menuSample);
+void moveBrowseCursor(int steps);
+void resetBrowseCursor();
+void runSequencer();
+void onClockEdge();
+void updateAudioClock();
+uint64_t frameAtUs(uint32_t us);
+void processClockEdges();
+void syncSequencerToClock();
+uint16_t clockBpm();
+void toggleSequencerEditing();
+void moveStepCursor(int steps);
+void toggleSequencer();
+void changeTempo(int delta);
+void saveSequencerState();
+bool restoreSequencerState();
 void updateButtons();
+void processTriggerEvents();
 void processButtonTriggers();
 void updateDisplay();
-bool copyWAVToFlash(const String& sdPath, const String& flashPath);
+void pushDisplay();
+void updateSequencerDisplay();
+void updateLevelMeters();
+void updateMeterDisplay();
+int meterHeight(uint32_t peak);
+bool copyWAVToFlash(const char* sdPath, const SampleIndexEntry& entry,
+                    const char* flashPath);
+CopyStart beginFlashCopy(FlashCopy& copy, const char* sdPath,
+                         const SampleIndexEntry& entry, const char* flashPath,
+                         bool mayCompact);
+bool stepFlashCopy(FlashCopy& copy);
+bool finishFlashCopy(FlashCopy& copy);
+void abortFlashCopy(FlashCopy& copy);
+int16_t decodeFrame(const uint8_t* bytes, uint16_t bitsPerSample,
+                    uint16_t numChannels);
+void buildWavHeader(uint8_t* header, uint32_t dataBytes, uint32_t sampleRate);
+void drawOverview(const WaveformOverview& overview, int top);
+void printOverview(const SampleVariant& variant);
 
 void setup() {
+  // Don't hold up boot waiting for a serial monitor
   Serial.begin(115200);
-  delay(2000);
 
   Serial.println("=== Eurorack Drum Machine - Flash Streaming ===");
-  Serial.printf("Sample Rate: %d Hz\n", SAMPLE_RATE);
+  Serial.printf("Sample Rate: %d Hz\n", Engine::sampleRate);
   Serial.printf("Stream Buffer Size: %d samples per voice\n",
-                STREAM_BUFFER_SIZE / 2);
+                Engine::ringSamples);
   Serial.printf("Max Flash Sample Size: %d bytes (~%.1f seconds)\n",
                 MAX_FLASH_SAMPLE_SIZE,
-                (float)MAX_FLASH_SAMPLE_SIZE / (SAMPLE_RATE * 2));
-  Serial.printf("Total RAM for streaming: %d bytes\n", 4 * STREAM_BUFFER_SIZE);
+                (float)MAX_FLASH_SAMPLE_SIZE / (Engine::sampleRate * 2));
+  Serial.printf("Total RAM for streaming: %d bytes (%d voices)\n",
+                streamPool.arenaBytes(), Engine::voices);
   Serial.println();
 
   pinMode(LED_BUILTIN, OUTPUT);
 
-  // Initialize button pins
-  for (int i = 0; i < 4; i++) {
-    pinMode(buttons[i].pin, INPUT_PULLUP);
-    Serial.printf("Initialized trigger button %d (%s) on GPIO%d\n", i + 1,
-                  buttons[i].name, buttons[i].pin);
+  // Initialize trigger pins (active low, captured on the falling edge)
+  for (int i = 0; i < Engine::channels; i++) {
+    pinMode(triggerInputs[i].pin, INPUT_PULLUP);
+    Serial.printf("Initialized trigger input %d (%s) on GPIO%d\n", i + 1,
+                  triggerInputs[i].name, triggerInputs[i].pin);
   }
 
+  // Claim PIO and DMA before I2S takes its share of them
+  initializeTriggerCapture();
+  initializeCvInput();
+
   for (int i = 0; i < 3; i++) {
-    pinMode(navButtons[i].pin, INPUT_PULLUP);
-    Serial.printf("Initialized nav button %s on GPIO%d\n", navButtons[i].name,
-                  navButtons[i].pin);
+    pinMode(navInputs[i].pin, INPUT_PULLUP);
+    Serial.printf("Initialized nav button %s on GPIO%d\n", navInputs[i].name,
+                  navInputs[i].pin);
   }
+  initializeEncoder();
+
+  pinMode(CLOCK_IN_PIN, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(CLOCK_IN_PIN), onClockEdge, FALLING);
+  Serial.printf("Initialized clock input on GPIO%d\n", CLOCK_IN_PIN);
 
   // Initialize I2C for OLED
   Wire.setSDA(SDA_PIN);
@@ -201,6 +690,16 @@ void setup() {
   } else {
     Serial.println("OLED display initialized");
     oledWorking = true;
+
+    // The library has sent its init sequence; frames go out by DMA from
+    // here on
+    Wire.setClock(OLED_I2C_HZ);
+    if (!oledPush.begin(i2c0, SCREEN_ADDRESS, display.getBuffer(),
+                        SCREEN_HEIGHT / 8)) {
+      Serial.println("No DMA channel for the OLED, using blocking I2C");
+    }
+
+    display.setTextWrap(false);
     display.clearDisplay();
     display.setTextSize(1);
     display.setTextColor(SSD1306_WHITE);
@@ -208,8 +707,7 @@ void setup() {
     display.println("Drum Machine");
     display.println("Flash Streaming");
     display.println("Initializing...");
-    display.display();
-    delay(1000);
+    pushDisplay();
   }
 
   // Initialize Flash filesystem
@@ -218,12 +716,15 @@ void setup() {
   // Initialize stream buffers
   initializeStreamBuffers();
 
-  // Initialize SD Card
-  initializeSDCard();
+  // Restore the last kit and bank from flash; SD is scanned later in the
+  // background
+  restoreKitState();
+  restoreBankState();
+  restoreSequencerState();
 
   // Initialize I2S
   i2s.setBitsPerSample(16);
-  if (!i2s.begin(SAMPLE_RATE)) {
+  if (!i2s.begin(Engine::sampleRate)) {
     Serial.println("Failed to initialize I2S!");
     while (1) {
       digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
@@ -235,9 +736,23 @@ void setup() {
   Serial.println("Commands:");
   Serial.println("  1-4: Trigger samples");
   Serial.println("  u/d: Navigate samples");
-  Serial.println("  s: Select sample (copy SD→Flash)");
+  Serial.println("  [/]: Browse folder (as the encoder)");
+  Serial.println("  s: Load browsed sample (copy SD→Flash)");
+  Serial.println("  a: Add browsed sample as another variant");
+  Serial.println("  m: Toggle velocity layers / round-robin");
+  Serial.println("  k: Import folder as CV bank when idle (again to clear)");
+  Serial.println("  p: Start/stop the sequencer");
+  Serial.println("  e: Toggle step edit (or hold select)");
+  Serial.println("  +/-: Sequencer tempo");
+  Serial.println("  </>: Sequencer swing");
+  Serial.println("  r: Ratchet the trigger (or the step)");
+  Serial.println("  y: Toggle ratchet decay");
   Serial.println("  l: List samples");
-  Serial.println("Flash streaming ready!");
+  Serial.println("  w: Print the loaded sample's waveform overview");
+  Serial.println("  b: Stream buffer pool stats");
+  Serial.println("  o: Display push stats");
+  Serial.println("  v: Toggle the level meter view");
+  Serial.printf("Flash streaming ready after %lums!\n", millis());
 
   if (oledWorking) {
     updateDisplay();
@@ -245,84 +760,242 @@ void setup() {
 }
 
 void loop() {
-  // Process button inputs
+  // Process trigger and button inputs
+  processTriggerEvents();
   updateButtons();
   processButtonTriggers();
+  serviceEncoder();
 
   // Check for serial input
   if (Serial.available()) {
     char input = Serial.read();
+    displayDirty = true;
 
     switch (input) {
       case '1':
-        triggerSample(0);
+        playHit(0, VELOCITY_UNITY, -1, 0, triggerRatchets[0]);
         break;
       case '2':
-        triggerSample(1);
+        playHit(1, VELOCITY_UNITY, -1, 0, triggerRatchets[1]);
         break;
       case '3':
-        triggerSample(2);
+        playHit(2, VELOCITY_UNITY, -1, 0, triggerRatchets[2]);
         break;
       case '4':
-        triggerSample(3);
+        playHit(3, VELOCITY_UNITY, -1, 0, triggerRatchets[3]);
         break;
       case 'u':  // Navigate up
-        currentMenuSample = (currentMenuSample - 1 + 4) % 4;
-        Serial.printf("Selected: %s\n",
-                      samplePlayers[currentMenuSample].folderName);
+        selectMenuSample((currentMenuSample - 1 + Engine::channels) %
+                         Engine::channels);
         break;
       case 'd':  // Navigate down
-        currentMenuSample = (currentMenuSample + 1) % 4;
-        Serial.printf("Selected: %s\n",
-                      samplePlayers[currentMenuSample].folderName);
+        selectMenuSample((currentMenuSample + 1) % Engine::channels);
+        break;
+      case '[':  // Browse previous sample (or step)
+        if (sequencerEditing) {
+          moveStepCursor(-1);
+        } else {
+          moveBrowseCursor(-1);
+        }
+        break;
+      case ']':  // Browse next sample (or step)
+        if (sequencerEditing) {
+          moveStepCursor(1);
+        } else {
+          moveBrowseCursor(1);
+        }
+        break;
+      case 's':  // Load browsed sample (or toggle the step)
+        if (sequencerEditing) {
+          sequencer.toggleStep(currentMenuSample, stepCursor);
+        } else {
+          loadSampleToFlash(currentMenuSample, browseSampleIndex);
+        }
+        break;
+      case 'p':  // Start/stop the sequencer
+        toggleSequencer();
+        break;
+      case 'e':  // Toggle step edit
+        toggleSequencerEditing();
         break;
-      case 's':  // Select sample (copy SD to Flash)
-        if (samplePlayers[currentMenuSample].totalSamples > 0) {
-          int nextIndex =
-              (samplePlayers[currentMenuSample].currentSampleIndex + 1) %
-              samplePlayers[currentMenuSample].totalSamples;
-          loadSampleToFlash(currentMenuSample, nextIndex);
+      case '+':
+        changeTempo(5);
+        break;
+      case '-':
+        changeTempo(-5);
+        break;
+      case '<':
+      case '>':
+        sequencer.setSwing(sequencer.current().swing + (input == '>' ? 5 : -5));
+        Serial.printf("Swing: %d%%\n", sequencer.current().swing);
+        saveSequencerState();
+        break;
+      case 'r':  // Ratchet the channel's jack triggers (or the step)
+        if (sequencerEditing) {
+          sequencer.cycleRatchet(currentMenuSample, stepCursor);
+        } else {
+          uint8_t& hits = triggerRatchets[currentMenuSample];
+          hits = hits % SEQUENCER_MAX_RATCHET + 1;
+          Serial.printf("%s triggers: %d hits per step\n",
+                        samplePlayers[currentMenuSample].folderName, hits);
+        }
+        break;
+      case 'y':  // Toggle ratchet decay
+        sequencer.setRatchetDecay(
+            sequencer.current().ratchetDecay ? 0 : RATCHET_DECAY_PERCENT);
+        Serial.printf("Ratchet decay: %d%%\n",
+                      sequencer.current().ratchetDecay);
+        saveSequencerState();
+        break;
+      case 'a':  // Add browsed sample as another variant
+        loadSampleToFlash(currentMenuSample, browseSampleIndex, true);
+        break;
+      case 'k':  // Import the folder as the CV bank, or clear it
+        if (sampleBank.channel == currentMenuSample) {
+          clearSampleBank();
+        } else {
+          startBankImport(currentMenuSample);
         }
         break;
+      case 'm': {  // Toggle variant selection mode
+        SamplePlayer& player = samplePlayers[currentMenuSample];
+        player.variantMode = player.variantMode == VARIANT_VELOCITY
+                                 ? VARIANT_ROUND_ROBIN
+                                 : VARIANT_VELOCITY;
+        Serial.printf("%s variants: %s\n", player.folderName,
+                      player.variantMode == VARIANT_VELOCITY ? "velocity layers"
+                                                             : "round-robin");
+        saveKitState();
+        break;
+      }
       case 'l':  // List samples
-        for (int i = 0; i < 4; i++) {
+        for (int i = 0; i < Engine::channels; i++) {
           Serial.printf("%s folder: %d samples\n", samplePlayers[i].folderName,
                         samplePlayers[i].totalSamples);
           for (int j = 0; j < samplePlayers[i].totalSamples; j++) {
-            Serial.printf("  %d: %s\n", j,
-                          samplePlayers[i].sampleList[j].c_str());
+            SampleIndexEntry entry;
+            if (samplePlayers[i].index.lookup(j, entry)) {
+              Serial.printf("  %d: %s\n", j, entry.name);
+            }
           }
         }
         break;
+      case 'v':  // Level meter view
+        meterView = !meterView;
+        Serial.printf("Meters: %d clipped samples\n",
+                      levelMeters.clippedSamples);
+        break;
+      case 'o':  // Display push stats
+        Serial.printf("Display: %d pushes, %d pages, %d aborts\n",
+                      oledPush.pushCount(), oledPush.pagesPushed(),
+                      oledPush.abortCount());
+        Serial.printf("Display work: last %dus, peak %dus\n",
+                      displayWorkUs, displayWorkPeakUs);
+        break;
+      case 'w': {  // Waveform overview of the shown variant
+        const SamplePlayer& player = samplePlayers[currentMenuSample];
+        if (player.variantCount > 0) {
+          printOverview(player.variants[player.variantCount - 1]);
+        }
+        break;
+      }
+      case 'b':  // Stream buffer pool stats
+        Serial.printf("Free heap: %d bytes\n", rp2040.getFreeHeap());
+        Serial.printf(
+            "Stream pool: %d/%d in use, peak %d, %d leases, %d failed\n",
+            streamPool.blocksInUse(), Engine::voices,
+            streamPool.peakBlocksInUse(), streamPool.leaseCount(),
+            streamPool.failedLeaseCount());
+        Serial.printf("Voices: %d stolen, %d idle blocks\n", voiceSteals,
+                      idleBlocks);
+        Serial.printf("Sample region: %d samples, %dKB free, %dKB gap%s\n",
+                      sampleRegion.sampleCount(),
+                      sampleRegion.freeBytes() / 1024,
+                      sampleRegion.largestGap() / 1024,
+                      sampleRegion.fragmented() ? ", fragmented" : "");
+        for (int i = 1; i <= Engine::voices; i++) {
+          if (mixBlocks[i] == 0) continue;
+          Serial.printf("  mix at %d voices: %d cycles/frame\n", i,
+                        (uint32_t)(mixCycles[i] /
+                                   ((uint64_t)mixBlocks[i] *
+                                    Engine::blockFrames)));
+        }
+        for (int i = 0; i < Engine::voices; i++) {
+          Serial.printf("  voice %d: %s, %d underruns\n", i,
+                        voices[i].playing
+                            ? samplePlayers[voices[i].channel].folderName
+                            : "idle",
+                        voices[i].underruns);
+        }
+        break;
     }
   }
 
-  // Generate and output audio samples continuously
-  for (int i = 0; i < 32; i++) {
-    int32_t mixedSample = 0;
+  // Start sequencer steps that fall in this block at their exact frames
+  processClockEdges();
+  runSequencer();
+  runRatchets();
 
-    // Mix all playing samples
-    for (int j = 0; j < 4; j++) {
-      if (samplePlayers[j].stream.playing && samplePlayers[j].stream.loaded) {
-        int16_t sample = getNextSample(j);
-        mixedSample += sample;
+  // Generate and output audio samples continuously. With nothing playing
+  // the block is silence, sent from a zeroed buffer without mixing.
+  if (!activeVoices) {
+    writeSilentBlock();
+    idleBlocks++;
+  } else {
+    // Render each playing voice's whole block in turn, then clamp and
+    // send the sum
+    static int32_t mix[Engine::blockFrames];
+    memset(mix, 0, sizeof(mix));
+
+    uint32_t voiceCount = __builtin_popcount(activeVoices);
+    uint32_t startCycles = rp2040.getCycleCount();
+    for (uint32_t mask = activeVoices; mask; mask &= mask - 1) {
+      int j = __builtin_ctz(mask);
+      uint32_t peak = renderVoice(j, mix);
+      if (peak > levelMeters.voicePeak[j]) {
+        levelMeters.voicePeak[j] = peak;
       }
     }
+    mixCycles[voiceCount] += rp2040.getCycleCount() - startCycles;
+    mixBlocks[voiceCount]++;
 
-    // Clamp mixed sample to 16-bit range
-    mixedSample = max(-32767, min(32767, mixedSample));
+    for (int i = 0; i < Engine::blockFrames; i++) {
+      int32_t mixedSample = mix[i];
 
-    // Write stereo samples
-    i2s.write16((int16_t)mixedSample, (int16_t)mixedSample);
-  }
+      uint32_t magnitude = abs(mixedSample);
+      if (magnitude > levelMeters.masterPeak) {
+        levelMeters.masterPeak = magnitude;
+      }
+      if (magnitude > 32767) {
+        levelMeters.clippedSamples++;
+      }
 
-  // Refill stream buffers as needed
-  for (int i = 0; i < 4; i++) {
-    if (samplePlayers[i].stream.playing &&
-        samplePlayers[i].stream.samplesInBuffer < REFILL_THRESHOLD) {
-      refillStreamBuffer(i);
+      // Clamp mixed sample to 16-bit range
+      mixedSample = max(-32767, min(32767, mixedSample));
+
+      // Write stereo samples
+      i2s.write16((int16_t)mixedSample, (int16_t)mixedSample);
     }
   }
+  audioFrame += Engine::blockFrames;
+  updateAudioClock();
+  updateLevelMeters();
+
+  // Refill stream buffers, most urgent first
+  scheduleStreamRefills();
+
+  if (activeVoices || activeRolls || sequencer.running()) {
+    lastPlayingMs = millis();
+  }
+
+  // Bring up SD and check sample indexes without blocking playback
+  if (scanState != SCAN_DONE) {
+    serviceSampleScan();
+  } else if (sampleBank.importNext >= 0) {
+    serviceBankImport();
+  } else {
+    serviceCompaction();
+  }
 
   // Blink LED to show activity
   static unsigned long last_blink = 0;
@@ -331,14 +1004,21 @@ void loop() {
     last_blink = millis();
   }
 
-  // Update display periodically
+  // Redraw after something on screen changed, coalescing bursts of
+  // changes into one frame
   static unsigned long lastDisplayUpdate = 0;
-  if (millis() - lastDisplayUpdate > 200) {
-    if (oledWorking) {
-      updateDisplay();
-    }
+  if (displayDirty && oledWorking &&
+      millis() - lastDisplayUpdate >= DISPLAY_FRAME_MS) {
+    displayDirty = false;
+    uint32_t start = time_us_32();
+    updateDisplay();
+    displayWorkUs = time_us_32() - start;
+    displayWorkPeakUs = max(displayWorkPeakUs, displayWorkUs);
     lastDisplayUpdate = millis();
   }
+
+  // Start sending the changed pages once the last transfer is done
+  oledPush.service();
 }
 
 // Initialize flash filesystem
@@ -352,139 +1032,500 @@ void initializeFlash() {
   }
 
   Serial.println("Flash filesystem initialized successfully");
+
+  // Samples go in the region below the filesystem, which the firmware
+  // image must stay clear of
+  uint32_t fsStart = (uint32_t)(uintptr_t)&_FS_start - XIP_BASE;
+  uint32_t imageEnd = (uint32_t)(uintptr_t)&__flash_binary_end - XIP_BASE;
+  uint32_t regionStart = fsStart - SAMPLE_REGION_BYTES;
+  if (imageEnd > regionStart) {
+    Serial.println("Firmware overlaps the sample region!");
+    flashWorking = false;
+    return;
+  }
   flashWorking = true;
 
-  // Create sample directories in flash
-  const char* dirs[] = {"/kick", "/snare", "/hihat", "/tom"};
-  for (int i = 0; i < 4; i++) {
-    if (!LittleFS.exists(dirs[i])) {
-      LittleFS.mkdir(dirs[i]);
-      Serial.printf("Created flash directory: %s\n", dirs[i]);
+  sampleRegion.begin(regionStart, SAMPLE_REGION_BYTES);
+  restoreRegionState();
+  Serial.printf("Sample region: %d samples, %dKB free at 0x%06x\n",
+                sampleRegion.sampleCount(), sampleRegion.freeBytes() / 1024,
+                regionStart);
+}
+
+// Persist the region's directory so the samples are found after a restart.
+// A sample still being written is left out until it is finished. Every
+// change to the directory is saved before the space it frees is reused,
+// so this is also where loaded variants learn where their copies went.
+void saveRegionState() {
+  locateVariants();
+  if (!flashWorking) return;
+
+  // Too big for the stack
+  static RegionStateRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = REGION_STATE_MAGIC;
+  record.version = REGION_STATE_VERSION;
+  for (int i = 0; i < sampleRegion.sampleCount(); i++) {
+    if (sampleRegion.complete(i)) {
+      record.extents[record.count++] = sampleRegion.extent(i);
+    }
+  }
+  record.checksum =
+      fnvChecksum(&record, offsetof(RegionStateRecord, checksum));
+
+  File file = LittleFS.open(REGION_STATE_PATH, "w");
+  if (!file || file.write((const uint8_t*)&record, sizeof(record)) !=
+                   sizeof(record)) {
+    Serial.println("Failed to save sample region");
+  }
+  if (file) file.close();
+}
+
+// Reload the directory saved by saveRegionState(). Only the layout is
+// checked here, so the kit can play at once; serviceCompaction() checks
+// the bytes later, while nothing is playing.
+void restoreRegionState() {
+  File file = LittleFS.open(REGION_STATE_PATH, "r");
+  if (!file) return;
+
+  static RegionStateRecord record;
+  size_t bytesRead = file.read((uint8_t*)&record, sizeof(record));
+  file.close();
+
+  if (bytesRead != sizeof(record) || record.magic != REGION_STATE_MAGIC ||
+      record.version != REGION_STATE_VERSION ||
+      record.count > REGION_MAX_SAMPLES ||
+      record.checksum !=
+          fnvChecksum(&record, offsetof(RegionStateRecord, checksum))) {
+    Serial.println("Saved sample region is invalid, ignoring it");
+    return;
+  }
+
+  for (int i = 0; i < record.count; i++) {
+    SampleStore::Extent& extent = record.extents[i];
+    extent.path[MAX_PATH_LEN - 1] = '\0';  // Never trust a string from flash
+    if (!sampleRegion.restore(extent)) {
+      Serial.printf("Dropped invalid flash sample: %s\n", extent.path);
+    }
+  }
+  if (sampleRegion.sampleCount() != record.count) {
+    saveRegionState();
+  }
+}
+
+// Point every loaded variant at its flash copy as the directory now has
+// it: moved, or gone if it was dropped
+void locateVariants() {
+  for (int p = 0; p < Engine::channels; p++) {
+    SamplePlayer& player = samplePlayers[p];
+    for (int i = 0; i < player.variantCount; i++) {
+      SampleVariant& variant = player.variants[i];
+      variant.flashFile =
+          sampleRegion.find(variant.flashPath, variant.flashBytes);
     }
   }
+  for (int i = 0; i < sampleBank.count; i++) {
+    SampleVariant& sample = sampleBank.samples[i];
+    sample.flashFile = sampleRegion.find(sample.flashPath, sample.flashBytes);
+  }
+}
+
+// Check the stored samples against their checksums, then close up the
+// gaps replaced samples leave, a step per pass. A compaction step stalls
+// loop() for a flash erase, so both only run once playback is idle. A
+// sample being moved still plays from its old copy, and the move only
+// completes while nothing is playing, so no voice is left streaming from
+// sectors that are about to be reused.
+void serviceCompaction() {
+  static uint32_t damagedReported = 0;
+  if (!playbackIdle()) return;
+
+  bool changed = sampleRegion.verifyStep(VERIFY_STEP_BYTES) ||
+                 (sampleRegion.fragmented() && sampleRegion.compactStep());
+  if (sampleRegion.damagedCount() != damagedReported) {
+    damagedReported = sampleRegion.damagedCount();
+    Serial.printf("Dropped damaged flash sample: %s\n",
+                  sampleRegion.lastDamaged());
+  }
+  if (changed) {
+    saveRegionState();
+  }
+}
+
+// True once nothing has played for FLASH_IDLE_MS
+bool playbackIdle() {
+  return millis() - lastPlayingMs >= FLASH_IDLE_MS;
 }
 
 // Initialize stream buffers
 void initializeStreamBuffers() {
   Serial.println("Initializing stream buffers...");
 
-  for (int i = 0; i < 4; i++) {
-    samplePlayers[i].stream.buffer = (int16_t*)malloc(STREAM_BUFFER_SIZE);
-    if (!samplePlayers[i].stream.buffer) {
-      Serial.printf("Failed to allocate stream buffer for %s\n",
-                    samplePlayers[i].folderName);
-      while (1) {
-        digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
-        delay(100);
-      }
+  for (int i = 0; i < Engine::voices; i++) {
+    // Buffers are leased from streamPool when the voice is triggered
+    voiceMix.ring[i].attach(nullptr);
+    voiceMix.gain[i] = VELOCITY_UNITY;
+    voices[i].flashData = nullptr;
+    voices[i].flashLeft = 0;
+    voices[i].variant = nullptr;
+    voices[i].playbackRate = PLAYBACK_RATE_UNITY;
+    voices[i].underruns = 0;
+    voices[i].startOrder = 0;
+    voices[i].channel = -1;
+    voices[i].playing = false;
+    voices[i].endOfFile = false;
+  }
+
+  Serial.printf("Stream pool: %d buffers of %d samples (%d bytes static)\n",
+                Engine::voices, Engine::ringSamples,
+                streamPool.arenaBytes());
+}
+
+// Trigger a sample to start playing at a Q15 velocity, startDelay frames
+// into the next block, on a voice of its own. On the bank channel a
+// bankSlot (from the CV input) picks the bank sample instead.
+void triggerSample(int sampleIndex, uint16_t velocity, int bankSlot,
+                   uint32_t startDelay) {
+  if (sampleIndex < 0 || sampleIndex >= Engine::channels) return;
+
+  SamplePlayer& player = samplePlayers[sampleIndex];
+
+  const SampleVariant* chosen;
+  if (sampleIndex == sampleBank.channel && bankSlot >= 0 &&
+      bankSlot < sampleBank.count) {
+    chosen = &sampleBank.samples[bankSlot];
+  } else if (player.variantCount > 0) {
+    chosen = &player.variants[selectVariant(player, velocity)];
+  } else {
+    Serial.printf("No sample loaded for %s\n", player.folderName);
+    return;
+  }
+
+  const SampleVariant& variant = *chosen;
+  bool needsStream = variant.totalSamples > variant.headSamples;
+  int voiceIndex = allocateVoice();
+  StreamingSample& stream = voices[voiceIndex];
+
+  // Lease a stream buffer; samples that fit in their attack head play
+  // from RAM alone
+  if (needsStream) {
+    voiceMix.ring[voiceIndex].attach(streamPool.acquire());
+    if (!voiceMix.ring[voiceIndex].storage()) {
+      Serial.printf("No free stream buffer for %s\n", player.folderName);
+      return;
     }
+  }
 
-    samplePlayers[i].stream.bufferSize =
-        STREAM_BUFFER_SIZE / 2;  // Convert bytes to samples
-    samplePlayers[i].stream.bufferHead = 0;
-    samplePlayers[i].stream.bufferTail = 0;
-    samplePlayers[i].stream.samplesInBuffer = 0;
-    samplePlayers[i].stream.totalSamples = 0;
-    samplePlayers[i].stream.samplesPlayed = 0;
-    samplePlayers[i].stream.playing = false;
-    samplePlayers[i].stream.loaded = false;
-    samplePlayers[i].stream.endOfFile = false;
+  // Reset playback position
+  voiceMix.head[voiceIndex] = variant.head;
+  voiceMix.played[voiceIndex] = 0;
+  voiceMix.headEnd[voiceIndex] = variant.headSamples;
+  voiceMix.remaining[voiceIndex] = variant.totalSamples;
+  voiceMix.delay[voiceIndex] = startDelay;
+  voiceMix.gain[voiceIndex] = velocity;
+  stream.variant = &variant;
+  stream.endOfFile = !needsStream;
+  stream.startOrder = voiceStarts++;
+  stream.channel = sampleIndex;
+  stream.playing = true;
+  activeVoices |= 1u << voiceIndex;
+  if (sampleIndex == currentMenuSample) {
+    displayDirty = true;
+  }
 
-    Serial.printf("Allocated %d sample buffer for %s\n",
-                  samplePlayers[i].stream.bufferSize,
-                  samplePlayers[i].folderName);
+  // Stream from the variant's flash copy. The head plays from RAM while
+  // the refill scheduler streams the rest in behind it, so skip the WAV
+  // header and the head.
+  if (needsStream) {
+    if (!variant.flashFile) {
+      Serial.printf("Flash sample unavailable: %s\n", variant.flashPath);
+      stopStream(voiceIndex);
+      return;
+    }
+    stream.flashData =
+        (const int16_t*)(variant.flashFile + 44) + variant.headSamples;
+    stream.flashLeft = variant.totalSamples - variant.headSamples;
   }
+
+  Serial.printf("Playing %s: %s\n", player.folderName, variant.filename);
 }
 
-// Trigger a sample to start playing
-void triggerSample(int sampleIndex) {
-  if (sampleIndex < 0 || sampleIndex >= 4) return;
+// Play a hit as `hits` evenly spaced repeats across one step, the first
+// startDelay frames into the next block. Jack triggers roll across a step
+// of the sequencer's tempo (or of the external clock). A new hit replaces
+// whatever is left of the channel's previous roll.
+void playHit(int sampleIndex, uint16_t velocity, int bankSlot,
+             uint32_t startDelay, int hits) {
+  if (sampleIndex < 0 || sampleIndex >= Engine::channels) return;
+
+  triggerSample(sampleIndex, velocity, bankSlot, startDelay);
+  activeRolls &= ~(1u << sampleIndex);
+  if (hits < 2) return;
+
+  RatchetRoll& roll = ratchetRolls[sampleIndex];
+  roll.intervalQ16 = sequencer.stepLength() / hits;
+  roll.nextFrameQ16 = ((audioFrame + startDelay) << 16) + roll.intervalQ16;
+  roll.velocity = velocity;
+  roll.remaining = hits - 1;
+  roll.bankSlot = bankSlot;
+  activeRolls |= 1u << sampleIndex;
+}
 
-  if (samplePlayers[sampleIndex].stream.loaded) {
-    // Reset playback position
-    samplePlayers[sampleIndex].stream.samplesPlayed = 0;
-    samplePlayers[sampleIndex].stream.bufferHead = 0;
-    samplePlayers[sampleIndex].stream.samplesInBuffer = 0;
-    samplePlayers[sampleIndex].stream.endOfFile = false;
-    samplePlayers[sampleIndex].stream.playing = true;
+// Start the ratchet repeats that fall in the block about to be mixed, each
+// at its own frame. Nothing to do unless a roll is under way.
+void runRatchets() {
+  if (!activeRolls) return;
+
+  uint64_t blockEndQ16 = (audioFrame + Engine::blockFrames) << 16;
+  uint32_t decay = 100 - sequencer.current().ratchetDecay;
+
+  for (int i = 0; i < Engine::channels; i++) {
+    if (!(activeRolls & (1u << i))) continue;
+
+    RatchetRoll& roll = ratchetRolls[i];
+    while (roll.remaining > 0 && roll.nextFrameQ16 < blockEndQ16) {
+      uint64_t frame = roll.nextFrameQ16 >> 16;
+      roll.velocity = roll.velocity * decay / 100;
+      triggerSample(i, roll.velocity, roll.bankSlot,
+                    frame > audioFrame ? frame - audioFrame : 0);
+      roll.nextFrameQ16 += roll.intervalQ16;
+      roll.remaining--;
+    }
+
+    if (roll.remaining == 0) {
+      activeRolls &= ~(1u << i);
+    }
+  }
+}
 
-    // Reopen flash file for streaming
-    if (samplePlayers[sampleIndex].stream.flashFile) {
-      samplePlayers[sampleIndex].stream.flashFile.close();
+// Claim a voice for a new hit: a free one, or else the one that started
+// longest ago
+int allocateVoice() {
+  int oldest = 0;
+  for (int i = 0; i < Engine::voices; i++) {
+    if (!voices[i].playing) return i;
+    if ((int32_t)(voices[i].startOrder - voices[oldest].startOrder) < 0) {
+      oldest = i;
     }
-    samplePlayers[sampleIndex].stream.flashFile =
-        LittleFS.open(samplePlayers[sampleIndex].stream.flashPath, "r");
+  }
 
-    if (samplePlayers[sampleIndex].stream.flashFile) {
-      // Skip WAV header (44 bytes)
-      samplePlayers[sampleIndex].stream.flashFile.seek(44);
+  voiceSteals++;
+  stopStream(oldest);
+  return oldest;
+}
 
-      // Fill initial buffer
-      refillStreamBuffer(sampleIndex);
+// Whether any voice is playing one of the channel's hits
+bool channelPlaying(int sampleIndex) {
+  for (int i = 0; i < Engine::voices; i++) {
+    if (voices[i].playing && voices[i].channel == sampleIndex) return true;
+  }
+  return false;
+}
 
-      Serial.printf("Playing %s: %s\n", samplePlayers[sampleIndex].folderName,
-                    samplePlayers[sampleIndex].stream.filename.c_str());
-    } else {
-      Serial.printf("Failed to open flash file: %s\n",
-                    samplePlayers[sampleIndex].stream.flashPath.c_str());
+// Stop every voice playing one of the channel's hits
+void stopChannel(int sampleIndex) {
+  for (int i = 0; i < Engine::voices; i++) {
+    if (voices[i].playing && voices[i].channel == sampleIndex) {
+      stopStream(i);
     }
-  } else {
-    Serial.printf("No sample loaded for %s\n",
-                  samplePlayers[sampleIndex].folderName);
   }
 }
 
-// Get next sample from stream buffer
-int16_t getNextSample(int playerIndex) {
-  StreamingSample& stream = samplePlayers[playerIndex].stream;
+// Pick the variant for a hit in O(1): the velocity slot's layer, or the
+// next one round-robin
+int selectVariant(SamplePlayer& player, uint16_t velocity) {
+  if (player.variantMode == VARIANT_ROUND_ROBIN) {
+    int variant = player.nextVariant;
+    player.nextVariant++;
+    if (player.nextVariant >= player.variantCount) {
+      player.nextVariant = 0;
+    }
+    return variant;
+  }
+
+  uint32_t slot = min((uint32_t)velocity, (uint32_t)VELOCITY_UNITY - 1) >>
+                  VELOCITY_LAYER_SHIFT;
+  return player.velocityLayer[slot];
+}
+
+// Split the velocity range evenly across the loaded variants
+void rebuildVelocityLayers(SamplePlayer& player) {
+  for (int slot = 0; slot < VELOCITY_LAYER_SLOTS; slot++) {
+    player.velocityLayer[slot] =
+        slot * max(player.variantCount, 1) / VELOCITY_LAYER_SLOTS;
+  }
+  player.nextVariant = 0;
+}
+
+// Mix one voice's share of the next block into mix[], a run at a time:
+// the scheduled start, then the attack head from RAM, then the stream
+// ring. Returns the voice's peak level for the meters.
+uint32_t renderVoice(int voiceIndex, int32_t* mix) {
+  uint32_t frame =
+      min(voiceMix.delay[voiceIndex], (uint32_t)Engine::blockFrames);
+  voiceMix.delay[voiceIndex] -= frame;
+
+  int32_t gain = voiceMix.gain[voiceIndex];
+  uint32_t played = voiceMix.played[voiceIndex];
+  uint32_t remaining = voiceMix.remaining[voiceIndex];
+  uint32_t peak = 0;
+
+  // Attack head, straight from RAM
+  const int16_t* head = voiceMix.head[voiceIndex];
+  uint32_t headEnd = voiceMix.headEnd[voiceIndex];
+  uint32_t run = min(Engine::blockFrames - frame,
+                     played < headEnd ? headEnd - played : 0);
+  for (uint32_t i = 0; i < run; i++) {
+    int32_t level = (head[played + i] * gain) >> 15;
+    mix[frame++] += level;
+    peak = max(peak, (uint32_t)abs(level));
+  }
+  played += run;
+  remaining -= run;
+
+  // Then the stream ring, as far as the refills have got
+  StreamRing& ring = voiceMix.ring[voiceIndex];
+  RingSpan<const int16_t> spans[2];
+  int spanCount =
+      ring.readSpans(spans, min(Engine::blockFrames - frame, remaining));
+  for (int s = 0; s < spanCount; s++) {
+    const int16_t* data = spans[s].data;
+    for (uint32_t i = 0; i < spans[s].count; i++) {
+      int32_t level = (data[i] * gain) >> 15;
+      mix[frame++] += level;
+      peak = max(peak, (uint32_t)abs(level));
+    }
+    ring.commitRead(spans[s].count);
+    played += spans[s].count;
+    remaining -= spans[s].count;
+  }
 
-  if (!stream.playing || stream.samplesInBuffer == 0) {
-    return 0;
+  // Refills didn't keep up with playback, or the file ended early
+  if (frame < Engine::blockFrames && remaining > 0) {
+    if (voices[voiceIndex].endOfFile) {
+      remaining = 0;
+    } else {
+      voices[voiceIndex].underruns += Engine::blockFrames - frame;
+    }
   }
 
-  // Get sample from circular buffer
-  int16_t sample = stream.buffer[stream.bufferHead];
-  stream.bufferHead = (stream.bufferHead + 1) % stream.bufferSize;
-  stream.samplesInBuffer--;
-  stream.samplesPlayed++;
+  voiceMix.played[voiceIndex] = played;
+  voiceMix.remaining[voiceIndex] = remaining;
 
   // Check if sample is finished
-  if (stream.samplesPlayed >= stream.totalSamples) {
-    stream.playing = false;
-    if (stream.flashFile) {
-      stream.flashFile.close();
-    }
+  if (remaining == 0) {
+    stopStream(voiceIndex);
   }
 
-  return sample;
+  return peak;
 }
 
-// Refill stream buffer from flash file
-void refillStreamBuffer(int playerIndex) {
-  StreamingSample& stream = samplePlayers[playerIndex].stream;
+// Stop a voice and hand its buffer back to the pool
+void stopStream(int voiceIndex) {
+  StreamingSample& stream = voices[voiceIndex];
 
-  if (!stream.flashFile || stream.endOfFile) return;
+  if (stream.playing && stream.channel == currentMenuSample) {
+    displayDirty = true;
+  }
+  stream.playing = false;
+  activeVoices &= ~(1u << voiceIndex);
 
-  // Fill buffer to capacity
-  while (stream.samplesInBuffer < stream.bufferSize && !stream.endOfFile) {
-    uint8_t bytes[2];
-    size_t bytesRead = stream.flashFile.read(bytes, 2);
+  streamPool.release(voiceMix.ring[voiceIndex].storage());
+  voiceMix.ring[voiceIndex].attach(nullptr);
+}
 
-    if (bytesRead == 2) {
-      // Convert bytes to 16-bit sample (little-endian)
-      int16_t sample = (int16_t)(bytes[0] | (bytes[1] << 8));
+// Refill stream buffer from flash, copying at most maxSamples.
+// Returns the number of samples added to the buffer.
+uint32_t refillStreamBuffer(int voiceIndex, uint32_t maxSamples) {
+  StreamingSample& stream = voices[voiceIndex];
+
+  if (stream.endOfFile) return 0;
+
+  // Copy straight into the ring's free space, in at most two pieces
+  // (flash data is 16-bit little-endian, same as the RP2040)
+  StreamRing& ring = voiceMix.ring[voiceIndex];
+  RingSpan<int16_t> spans[2];
+  int spanCount = ring.writeSpans(spans, min(maxSamples, stream.flashLeft));
+
+  uint32_t added = 0;
+  for (int s = 0; s < spanCount; s++) {
+    memcpy(spans[s].data, stream.flashData, spans[s].count * 2);
+    stream.flashData += spans[s].count;
+    ring.commitWrite(spans[s].count);
+    added += spans[s].count;
+  }
 
-      // Add to circular buffer
-      stream.buffer[stream.bufferTail] = sample;
-      stream.bufferTail = (stream.bufferTail + 1) % stream.bufferSize;
-      stream.samplesInBuffer++;
-    } else {
-      stream.endOfFile = true;
+  stream.flashLeft -= added;
+  if (stream.flashLeft == 0) {
+    stream.endOfFile = true;
+  }
+  return added;
+}
+
+// Output frames until a stream's buffer runs dry at its current rate,
+// counting what is left of the attack head
+uint32_t framesUntilEmpty(int voiceIndex) {
+  uint32_t available = voiceMix.ring[voiceIndex].size();
+  uint32_t played = voiceMix.played[voiceIndex];
+  if (played < voiceMix.headEnd[voiceIndex]) {
+    available += voiceMix.headEnd[voiceIndex] - played;
+  }
+  return (available << 16) / voices[voiceIndex].playbackRate +
+         voiceMix.delay[voiceIndex];
+}
+
+// Earliest-deadline-first refill: repeatedly top up the voice that will run
+// dry soonest, one chunk at a time, until the per-block I/O budget is spent
+void scheduleStreamRefills() {
+  uint32_t budget = REFILL_BUDGET_SAMPLES;
+
+  while (budget > 0) {
+    int urgent = -1;
+    uint32_t earliestDeadline = UINT32_MAX;
+
+    for (uint32_t mask = activeVoices; mask; mask &= mask - 1) {
+      int i = __builtin_ctz(mask);
+      const StreamingSample& stream = voices[i];
+      if (stream.endOfFile) continue;
+
+      // Not worth a flash read until a whole chunk fits
+      if (voiceMix.ring[i].space() < REFILL_CHUNK_SAMPLES) continue;
+
+      uint32_t deadline = framesUntilEmpty(i);
+      if (deadline < earliestDeadline) {
+        earliestDeadline = deadline;
+        urgent = i;
+      }
     }
+
+    if (urgent < 0) break;
+
+    uint32_t added =
+        refillStreamBuffer(urgent, min(budget, (uint32_t)REFILL_CHUNK_SAMPLES));
+    if (added == 0) break;
+    budget -= added;
   }
 }
 
-// Initialize SD Card
+// Send one block of silence from a zeroed buffer. While the I2S DMA
+// buffers are full the core sleeps until the next interrupt (the DMA
+// completing a buffer) instead of spinning.
+void writeSilentBlock() {
+  static const uint32_t silence[Engine::blockFrames] = {};  // Stereo frames
+
+  const uint8_t* data = (const uint8_t*)silence;
+  size_t remaining = sizeof(silence);
+  while (remaining > 0) {
+    size_t written = i2s.write(data, remaining);
+    data += written;
+    remaining -= written;
+    if (remaining > 0) {
+      __wfi();
+    }
+  }
+}
+
+// Initialize SD Card and open each folder's existing sample index
 void initializeSDCard() {
   Serial.println("Initializing SD card...");
 
@@ -502,136 +1543,547 @@ void initializeSDCard() {
   Serial.println("SD card initialized successfully");
   sdCardWorking = true;
 
-  // Scan for sample folders
-  scanSampleFolders();
+  // Lookups work from the existing indexes straight away
+  for (int i = 0; i < Engine::channels; i++) {
+    char folderPath[MAX_PATH_LEN];
+    snprintf(folderPath, sizeof(folderPath), "/%s",
+             samplePlayers[i].folderName);
+    samplePlayers[i].index.open(folderPath);
+    samplePlayers[i].totalSamples = samplePlayers[i].index.count();
+  }
+  resetBrowseCursor();
 }
 
-// Scan SD card for sample folders and files
-void scanSampleFolders() {
-  if (!sdCardWorking) return;
+// Advance the background SD scan: bring up the card, then walk one folder
+// at a time and rebuild its index only if its listing changed
+void serviceSampleScan() {
+  switch (scanState) {
+    case SCAN_PENDING:
+      scanStartTime = millis();
+      scanStartHeap = rp2040.getFreeHeap();
+      Serial.printf("Scan heap: %d bytes free before\n", scanStartHeap);
+      initializeSDCard();
+      if (!sdCardWorking) {
+        finishSampleScan();
+        break;
+      }
+      Serial.println("Scanning for sample folders...");
+      scanFolder = 0;
+      samplePlayers[scanFolder].index.beginSync();
+      scanState = SCAN_FOLDERS;
+      break;
+
+    case SCAN_FOLDERS: {
+      SampleFolderIndex& index = samplePlayers[scanFolder].index;
+      uint32_t rebuildsBefore = index.rebuildCount();
+      if (!index.syncStep(INDEX_SYNC_FILES_PER_STEP)) break;
+
+      samplePlayers[scanFolder].totalSamples = index.count();
+      if (scanFolder == currentMenuSample) {
+        resetBrowseCursor();
+      }
+      Serial.printf("Folder %s: %d samples%s\n",
+                    samplePlayers[scanFolder].folderName, index.count(),
+                    index.rebuildCount() != rebuildsBefore ? " (reindexed)"
+                                                           : "");
+
+      scanFolder++;
+      if (scanFolder < Engine::channels) {
+        samplePlayers[scanFolder].index.beginSync();
+      } else {
+        finishSampleScan();
+      }
+      break;
+    }
 
-  Serial.println("Scanning for sample folders...");
+    case SCAN_DONE:
+      break;
+  }
+}
 
-  for (int i = 0; i < 4; i++) {
-    String folderPath = "/" + String(samplePlayers[i].folderName);
-    File folder = SD.open(folderPath);
+// Report the scan's time and heap use, and hand loop() back to playback
+void finishSampleScan() {
+  Serial.printf("Sample scan took %lums\n", millis() - scanStartTime);
+  Serial.printf("Scan heap: %d bytes free before, %d after\n", scanStartHeap,
+                rp2040.getFreeHeap());
+  scanState = SCAN_DONE;
+}
 
-    if (!folder || !folder.isDirectory()) {
-      Serial.printf("Folder %s not found\n", folderPath.c_str());
-      samplePlayers[i].totalSamples = 0;
-      continue;
-    }
+// Load sample from SD card to flash storage, either replacing the
+// channel's variants or adding it as the next (louder) one
+void loadSampleToFlash(int playerIndex, int sampleIndex, bool addVariant) {
+  if (playerIndex < 0 || playerIndex >= Engine::channels) return;
+  SamplePlayer& player = samplePlayers[playerIndex];
+  if (sampleIndex < 0 || sampleIndex >= player.totalSamples) return;
 
-    int sampleCount = 0;
-    File file = folder.openNextFile();
+  if (addVariant && player.variantCount >= MAX_VARIANTS) {
+    Serial.printf("%s already has %d variants\n", player.folderName,
+                  MAX_VARIANTS);
+    return;
+  }
 
-    while (file && sampleCount < 16) {
-      if (!file.isDirectory()) {
-        String filename = file.name();
+  SampleIndexEntry entry;
+  if (!player.index.lookup(sampleIndex, entry)) {
+    Serial.printf("Sample index lookup failed: %s #%d\n", player.folderName,
+                  sampleIndex);
+    return;
+  }
+  const char* filename = entry.name;
 
-        // Skip hidden files
-        if (filename.startsWith(".")) {
-          Serial.printf("Skipping hidden file: %s\n", filename.c_str());
-          file.close();
-          file = folder.openNextFile();
-          continue;
-        }
+  // SD and flash use the same /folder/filename layout
+  char samplePath[MAX_PATH_LEN];
+  snprintf(samplePath, sizeof(samplePath), "/%s/%s", player.folderName,
+           filename);
 
-        filename.toLowerCase();
+  Serial.printf("Loading sample from SD to Flash: %s\n", samplePath);
 
-        // Check if it's a WAV file
-        if (filename.endsWith(".wav")) {
-          samplePlayers[i].sampleList[sampleCount] = file.name();
-          sampleCount++;
-          Serial.printf("Found: %s/%s\n", folderPath.c_str(), file.name());
-        }
+  // Stop playback of the channel's current flash copies
+  stopChannel(playerIndex);
+
+  // Replacing: drop the old variants' flash copies first, so their space
+  // is free for the new one. A copy under the same path is replaced by
+  // the copy itself.
+  if (!addVariant) {
+    for (int i = 0; i < player.variantCount; i++) {
+      if (strcmp(player.variants[i].flashPath, samplePath) != 0) {
+        sampleRegion.remove(player.variants[i].flashPath);
       }
-      file.close();
-      file = folder.openNextFile();
     }
+    player.variantCount = 0;
+    saveRegionState();
+  }
 
-    samplePlayers[i].totalSamples = sampleCount;
-    Serial.printf("Folder %s: %d samples found\n", samplePlayers[i].folderName,
-                  sampleCount);
+  // The region stores one sample at a time. A kit load blocks anyway, so
+  // the file a bank import is on is finished here rather than waiting for
+  // playback to go idle.
+  if (sampleBank.copy.active) {
+    while (stepFlashCopy(sampleBank.copy)) {
+    }
+    finishBankSample();
+  }
 
-    folder.close();
+  // Copy WAV file from SD to flash
+  if (!copyWAVToFlash(samplePath, entry, samplePath)) {
+    Serial.printf("Failed to load sample: %s\n", filename);
+    if (!addVariant) saveKitState();
+    return;
   }
+
+  SampleVariant& variant = player.variants[player.variantCount];
+  snprintf(variant.flashPath, sizeof(variant.flashPath), "%s", samplePath);
+  snprintf(variant.filename, sizeof(variant.filename), "%s", filename);
+  variant.sampleIndex = sampleIndex;
+  if (!loadVariantHead(variant)) {
+    Serial.printf("Failed to read flash sample: %s\n", samplePath);
+    saveKitState();
+    return;
+  }
+
+  player.variantCount++;
+  rebuildVelocityLayers(player);
+  player.currentSampleIndex = sampleIndex;
+  if (playerIndex == currentMenuSample) {
+    resetBrowseCursor();
+  }
+
+  Serial.printf("Sample loaded to flash: %s (variant %d/%d)\n", filename,
+                player.variantCount, MAX_VARIANTS);
+  Serial.printf("Flash sample info: %d samples (%.2f seconds)\n",
+                variant.totalSamples,
+                (float)variant.totalSamples / Engine::sampleRate);
+
+  saveKitState();
 }
 
-// Load sample from SD card to flash storage
-void loadSampleToFlash(int playerIndex, int sampleIndex) {
-  if (playerIndex < 0 || playerIndex >= 4) return;
-  if (sampleIndex < 0 || sampleIndex >= samplePlayers[playerIndex].totalSamples)
+// Find a variant's flash copy and read its length and attack head from it
+bool loadVariantHead(SampleVariant& variant) {
+  variant.flashFile = sampleRegion.find(variant.flashPath, variant.flashBytes);
+  const uint8_t* file = variant.flashFile;
+  uint32_t length = variant.flashBytes;
+  if (!file || length < 44) return false;
+
+  // Data size is at offset 40 of the canonical header
+  uint32_t dataSize;
+  memcpy(&dataSize, file + 40, 4);
+  if (dataSize > length - 44) return false;
+  variant.totalSamples = dataSize / 2;  // 16-bit samples
+
+  // Samples follow the 44-byte header
+  variant.headSamples =
+      min(variant.totalSamples, (uint32_t)ATTACK_HEAD_SAMPLES);
+  memcpy(variant.head, file + 44, variant.headSamples * 2);
+
+  // The overview chunk follows the audio
+  const uint8_t* chunk = file + 44 + dataSize;
+  uint32_t chunkSize = 0;
+  if (length - 44 - dataSize >= 8 + sizeof(WaveformOverview)) {
+    memcpy(&chunkSize, chunk + 4, 4);
+  }
+  if (chunkSize == sizeof(WaveformOverview) &&
+      memcmp(chunk, OVERVIEW_CHUNK_ID, 4) == 0) {
+    memcpy(&variant.overview, chunk + 8, sizeof(WaveformOverview));
+  } else {
+    memset(&variant.overview, 0, sizeof(variant.overview));
+  }
+  return true;
+}
+
+// FNV-1a checksum of a persisted record
+uint32_t fnvChecksum(const void* data, size_t length) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Checksum of a kit record, excluding the checksum field itself
+uint32_t kitChecksum(const KitStateRecord& record) {
+  return fnvChecksum(&record, offsetof(KitStateRecord, checksum));
+}
+
+// Persist the current kit mapping so the next boot can skip the SD card
+void saveKitState() {
+  if (!flashWorking) return;
+
+  // Too big for the stack
+  static KitStateRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = KIT_STATE_MAGIC;
+  record.version = KIT_STATE_VERSION;
+  record.channelCount = Engine::channels;
+
+  for (int i = 0; i < Engine::channels; i++) {
+    const SamplePlayer& player = samplePlayers[i];
+    KitChannelRecord& channel = record.channels[i];
+    for (int v = 0; v < player.variantCount; v++) {
+      const SampleVariant& variant = player.variants[v];
+      KitVariantRecord& saved = channel.variants[v];
+      memcpy(saved.filename, variant.filename, sizeof(saved.filename));
+      memcpy(saved.flashPath, variant.flashPath, sizeof(saved.flashPath));
+      saved.sampleIndex = variant.sampleIndex;
+    }
+    channel.sampleIndex = player.currentSampleIndex;
+    channel.variantCount = player.variantCount;
+    channel.variantMode = player.variantMode;
+  }
+  record.checksum = kitChecksum(record);
+
+  // Write beside the old record and swap, so a power cut can't corrupt it
+  File file = LittleFS.open(KIT_STATE_TEMP_PATH, "w");
+  if (!file) {
+    Serial.println("Failed to save kit state");
     return;
+  }
+  size_t written = file.write((const uint8_t*)&record, sizeof(record));
+  file.close();
 
-  String filename = samplePlayers[playerIndex].sampleList[sampleIndex];
-  String sdPath =
-      "/" + String(samplePlayers[playerIndex].folderName) + "/" + filename;
-  String flashPath =
-      "/" + String(samplePlayers[playerIndex].folderName) + "/" + filename;
+  if (written != sizeof(record)) {
+    Serial.println("Failed to save kit state");
+    LittleFS.remove(KIT_STATE_TEMP_PATH);
+    return;
+  }
 
-  Serial.printf("Loading sample from SD to Flash: %s\n", sdPath.c_str());
+  LittleFS.remove(KIT_STATE_PATH);
+  LittleFS.rename(KIT_STATE_TEMP_PATH, KIT_STATE_PATH);
+}
+
+// Reload the kit mapping saved by saveKitState(), reading each variant's
+// attack head back into RAM. Variants whose flash sample has gone missing
+// are dropped.
+bool restoreKitState() {
+  if (!flashWorking) return false;
 
-  // Close any existing flash file
-  if (samplePlayers[playerIndex].stream.flashFile) {
-    samplePlayers[playerIndex].stream.flashFile.close();
+  File file = LittleFS.open(KIT_STATE_PATH, "r");
+  if (!file) {
+    Serial.println("No saved kit state");
+    return false;
   }
 
-  // Copy WAV file from SD to flash
-  if (copyWAVToFlash(sdPath, flashPath)) {
-    samplePlayers[playerIndex].stream.flashPath = flashPath;
-    samplePlayers[playerIndex].stream.filename = filename;
-    samplePlayers[playerIndex].stream.loaded = true;
-    samplePlayers[playerIndex].currentSampleIndex = sampleIndex;
-
-    Serial.printf("Sample loaded to flash: %s\n", filename.c_str());
-
-    // Get sample info from flash file
-    File flashFile = LittleFS.open(flashPath, "r");
-    if (flashFile) {
-      // Read WAV header to get sample count
-      flashFile.seek(40);  // Data size is at offset 40
-      uint32_t dataSize = 0;
-      flashFile.read((uint8_t*)&dataSize, 4);
-      samplePlayers[playerIndex].stream.totalSamples =
-          dataSize / 2;  // 16-bit samples
-      flashFile.close();
-
-      Serial.printf(
-          "Flash sample info: %d samples (%.2f seconds)\n",
-          samplePlayers[playerIndex].stream.totalSamples,
-          (float)samplePlayers[playerIndex].stream.totalSamples / SAMPLE_RATE);
+  static KitStateRecord record;
+  size_t bytesRead = file.read((uint8_t*)&record, sizeof(record));
+  file.close();
+
+  if (bytesRead != sizeof(record) || record.magic != KIT_STATE_MAGIC ||
+      record.version != KIT_STATE_VERSION ||
+      record.channelCount != Engine::channels ||
+      record.checksum != kitChecksum(record)) {
+    Serial.println("Saved kit state is invalid, ignoring it");
+    return false;
+  }
+
+  for (int i = 0; i < Engine::channels; i++) {
+    const KitChannelRecord& channel = record.channels[i];
+    SamplePlayer& player = samplePlayers[i];
+    player.variantCount = 0;
+    player.variantMode = channel.variantMode == VARIANT_ROUND_ROBIN
+                             ? VARIANT_ROUND_ROBIN
+                             : VARIANT_VELOCITY;
+    player.currentSampleIndex = channel.sampleIndex;
+
+    int savedCount = min((int)channel.variantCount, MAX_VARIANTS);
+    for (int v = 0; v < savedCount; v++) {
+      const KitVariantRecord& saved = channel.variants[v];
+      SampleVariant& variant = player.variants[player.variantCount];
+
+      // Records are zero-filled, but never trust a string from flash
+      snprintf(variant.flashPath, sizeof(variant.flashPath), "%.*s",
+               MAX_PATH_LEN - 1, saved.flashPath);
+      snprintf(variant.filename, sizeof(variant.filename), "%.*s",
+               MAX_NAME_LEN - 1, saved.filename);
+      variant.sampleIndex = saved.sampleIndex;
+
+      if (!loadVariantHead(variant)) {
+        Serial.printf("Saved %s sample missing from flash: %s\n",
+                      player.folderName, variant.flashPath);
+        continue;
+      }
+      player.variantCount++;
+
+      Serial.printf("Restored %s: %s\n", player.folderName, variant.filename);
     }
-  } else {
-    Serial.printf("Failed to load sample: %s\n", filename.c_str());
+    rebuildVelocityLayers(player);
   }
+
+  return true;
 }
 
-// Copy WAV file from SD to flash with format conversion
-bool copyWAVToFlash(const String& sdPath, const String& flashPath) {
-  File sdFile = SD.open(sdPath);
-  if (!sdFile) {
-    Serial.printf("Failed to open SD file: %s\n", sdPath.c_str());
+// Start importing every sample in a channel's folder into the bank,
+// replacing whatever bank was there before
+void startBankImport(int playerIndex) {
+  if (samplePlayers[playerIndex].totalSamples == 0) {
+    Serial.printf("No samples to bank in %s\n",
+                  samplePlayers[playerIndex].folderName);
+    return;
+  }
+
+  clearSampleBank();
+  sampleBank.channel = playerIndex;
+  sampleBank.importNext = 0;
+  Serial.printf("Importing %s folder into the CV bank while idle...\n",
+                samplePlayers[playerIndex].folderName);
+}
+
+// Drop the bank and its flash copies
+void clearSampleBank() {
+  if (sampleBank.channel >= 0) {
+    // Voices may be streaming the bank's samples
+    stopChannel(sampleBank.channel);
+    Serial.printf("Cleared %s CV bank\n",
+                  samplePlayers[sampleBank.channel].folderName);
+  }
+
+  abortFlashCopy(sampleBank.copy);
+  for (int i = 0; i < sampleBank.count; i++) {
+    sampleRegion.remove(sampleBank.samples[i].flashPath);
+  }
+  saveRegionState();
+  sampleBank.channel = -1;
+  sampleBank.count = 0;
+  sampleBank.importNext = -1;
+  sampleBank.awaitingRoom = false;
+  saveBankState();
+}
+
+// Advance the bank import by one step: start copying the next sample,
+// convert another FLASH_COPY_FRAMES of it, or finish it. Each pass costs
+// at most a few SD reads and a flash page. Erasing the sample's sectors,
+// closing it off and compacting to make room all stall loop(), so they
+// wait for playback to go idle, and the import with them.
+void serviceBankImport() {
+  FlashCopy& copy = sampleBank.copy;
+  uint32_t stepBytes = FLASH_COPY_FRAMES * 2 + 8 + sizeof(WaveformOverview);
+
+  if (sampleBank.awaitingRoom) {
+    if (sampleRegion.fragmented()) {
+      serviceCompaction();
+      return;
+    }
+    sampleBank.awaitingRoom = false;
+    startBankSample();
+  } else if (!copy.active) {
+    startBankSample();
+  } else if (copy.samplesDone < copy.totalSamples &&
+             sampleRegion.erasedFor(stepBytes)) {
+    stepFlashCopy(copy);
+  } else if (playbackIdle() && !sampleRegion.eraseAhead()) {
+    finishBankSample();
+  }
+}
+
+// Start copying the bank's next sample to flash. One that only fits once
+// the gaps are closed up waits for compaction; one that can't be copied
+// is skipped.
+void startBankSample() {
+  SamplePlayer& player = samplePlayers[sampleBank.channel];
+  int position = sampleBank.importNext;
+
+  SampleIndexEntry entry;
+  if (sampleBank.count < BANK_MAX_SAMPLES &&
+      player.index.lookup(position, entry)) {
+    char sdPath[MAX_PATH_LEN];
+    snprintf(sdPath, sizeof(sdPath), "/%s/%s", player.folderName,
+             entry.name);
+
+    SampleVariant& sample = sampleBank.samples[sampleBank.count];
+    snprintf(sample.flashPath, sizeof(sample.flashPath), "%s/%s",
+             BANK_FLASH_DIR, entry.name);
+    snprintf(sample.filename, sizeof(sample.filename), "%s", entry.name);
+    sample.sampleIndex = position;
+
+    CopyStart start = beginFlashCopy(sampleBank.copy, sdPath, entry,
+                                     sample.flashPath, false);
+    if (start == COPY_NEEDS_ROOM) {
+      sampleBank.awaitingRoom = true;
+    }
+    if (start != COPY_FAILED) return;
+  }
+
+  advanceBankImport();
+}
+
+// Finish the sample being copied and keep its attack head. One that fails
+// is dropped from flash and skipped.
+void finishBankSample() {
+  SampleVariant& sample = sampleBank.samples[sampleBank.count];
+  if (finishFlashCopy(sampleBank.copy) && loadVariantHead(sample)) {
+    sampleBank.count++;
+    displayDirty = true;
+  } else if (sampleRegion.remove(sample.flashPath)) {
+    saveRegionState();
+  }
+
+  advanceBankImport();
+}
+
+// Move on to the next file in the folder, or wrap the import up
+void advanceBankImport() {
+  SamplePlayer& player = samplePlayers[sampleBank.channel];
+  sampleBank.importNext++;
+  if (sampleBank.importNext >= player.totalSamples ||
+      sampleBank.count >= BANK_MAX_SAMPLES) {
+    sampleBank.importNext = -1;
+    Serial.printf("CV bank for %s: %d samples\n", player.folderName,
+                  sampleBank.count);
+    saveBankState();
+  }
+}
+
+// Persist the bank so it comes back, heads and all, on the next boot
+void saveBankState() {
+  if (!flashWorking) return;
+
+  // Too big for the stack
+  static BankStateRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = BANK_STATE_MAGIC;
+  record.version = BANK_STATE_VERSION;
+  record.channel = sampleBank.channel;
+  record.count = sampleBank.count;
+  for (int i = 0; i < sampleBank.count; i++) {
+    const SampleVariant& sample = sampleBank.samples[i];
+    KitVariantRecord& saved = record.samples[i];
+    memcpy(saved.filename, sample.filename, sizeof(saved.filename));
+    memcpy(saved.flashPath, sample.flashPath, sizeof(saved.flashPath));
+    saved.sampleIndex = sample.sampleIndex;
+  }
+  record.checksum = fnvChecksum(&record, offsetof(BankStateRecord, checksum));
+
+  File file = LittleFS.open(BANK_STATE_PATH, "w");
+  if (!file || file.write((const uint8_t*)&record, sizeof(record)) !=
+                   sizeof(record)) {
+    Serial.println("Failed to save CV bank");
+  }
+  if (file) file.close();
+}
+
+// Reload the bank saved by saveBankState() and read its attack heads back
+// into RAM
+bool restoreBankState() {
+  if (!flashWorking) return false;
+
+  File file = LittleFS.open(BANK_STATE_PATH, "r");
+  if (!file) return false;
+
+  static BankStateRecord record;
+  size_t bytesRead = file.read((uint8_t*)&record, sizeof(record));
+  file.close();
+
+  if (bytesRead != sizeof(record) || record.magic != BANK_STATE_MAGIC ||
+      record.version != BANK_STATE_VERSION || record.channel < 0 ||
+      record.channel >= Engine::channels || record.count > BANK_MAX_SAMPLES ||
+      record.checksum !=
+          fnvChecksum(&record, offsetof(BankStateRecord, checksum))) {
     return false;
   }
 
-  // Read WAV header
-  uint8_t header[44];
-  if (sdFile.read(header, 44) != 44) {
-    Serial.println("Failed to read WAV header");
-    sdFile.close();
+  sampleBank.channel = record.channel;
+  sampleBank.count = 0;
+  for (uint32_t i = 0; i < record.count; i++) {
+    const KitVariantRecord& saved = record.samples[i];
+    SampleVariant& sample = sampleBank.samples[sampleBank.count];
+
+    // Never trust a string from flash
+    snprintf(sample.flashPath, sizeof(sample.flashPath), "%.*s",
+             MAX_PATH_LEN - 1, saved.flashPath);
+    snprintf(sample.filename, sizeof(sample.filename), "%.*s",
+             MAX_NAME_LEN - 1, saved.filename);
+    sample.sampleIndex = saved.sampleIndex;
+
+    if (loadVariantHead(sample)) {
+      sampleBank.count++;
+    }
+  }
+
+  Serial.printf("Restored %s CV bank: %d samples\n",
+                samplePlayers[sampleBank.channel].folderName,
+                sampleBank.count);
+  return true;
+}
+
+// Copy WAV file from SD to flash with format conversion, all at once
+bool copyWAVToFlash(const char* sdPath, const SampleIndexEntry& entry,
+                    const char* flashPath) {
+  // Too big for the stack
+  static FlashCopy copy;
+  if (beginFlashCopy(copy, sdPath, entry, flashPath, true) != COPY_STARTED) {
     return false;
   }
+  while (stepFlashCopy(copy)) {
+  }
+  return finishFlashCopy(copy);
+}
 
-  // Parse WAV header
-  uint32_t sampleRate = *(uint32_t*)(header + 24);
-  uint16_t bitsPerSample = *(uint16_t*)(header + 34);
-  uint16_t numChannels = *(uint16_t*)(header + 22);
-  uint32_t dataSize = *(uint32_t*)(header + 40);
+// Open a WAV on SD and claim room in the sample region for its converted
+// copy, writing the header. Nothing is claimed unless the copy started.
+// Only a caller that may block is allowed to compact here; others get
+// COPY_NEEDS_ROOM when the copy would fit once the gaps are closed up.
+CopyStart beginFlashCopy(FlashCopy& copy, const char* sdPath,
+                         const SampleIndexEntry& entry, const char* flashPath,
+                         bool mayCompact) {
+  // Format comes from the sample index
+  uint32_t sampleRate = entry.sampleRate;
+  uint16_t bitsPerSample = entry.bitsPerSample;
+  uint16_t numChannels = entry.channels;
+  uint32_t dataSize = entry.dataBytes;
 
   Serial.printf("WAV: %dHz, %d-bit, %d channels, %d bytes\n", sampleRate,
                 bitsPerSample, numChannels, dataSize);
 
+  if ((bitsPerSample != 16 && bitsPerSample != 24) || numChannels < 1 ||
+      numChannels > 2) {
+    Serial.println("Unsupported WAV format (need 16/24-bit mono/stereo)");
+    return COPY_FAILED;
+  }
+
+  File sdFile = SD.open(sdPath);
+  if (!sdFile || !sdFile.seek(entry.dataOffset)) {
+    Serial.printf("Failed to open SD file: %s\n", sdPath);
+    if (sdFile) sdFile.close();
+    return COPY_FAILED;
+  }
+
   // Check if sample is too large
   if (dataSize > MAX_FLASH_SAMPLE_SIZE) {
     Serial.printf("Sample too large: %d bytes (max %d)\n", dataSize,
@@ -639,174 +2091,748 @@ bool copyWAVToFlash(const String& sdPath, const String& flashPath) {
     dataSize = MAX_FLASH_SAMPLE_SIZE;
   }
 
-  // Create flash file
-  File flashFile = LittleFS.open(flashPath, "w");
-  if (!flashFile) {
-    Serial.printf("Failed to create flash file: %s\n", flashPath.c_str());
-    sdFile.close();
-    return false;
+  // The copy is a canonical 44-byte WAV header (converted to 16-bit
+  // mono), the audio, then the overview chunk; the RIFF size covers it all
+  uint8_t header[44];
+  uint32_t totalSamples = dataSize / (bitsPerSample / 8) / numChannels;
+  uint32_t newDataSize = totalSamples * 2;  // Convert to 16-bit mono
+  buildWavHeader(header, newDataSize, sampleRate);
+  *(uint32_t*)(header + 4) += 8 + sizeof(WaveformOverview);
+  uint32_t copyBytes = 44 + newDataSize + 8 + sizeof(WaveformOverview);
+
+  // An older copy is dropped from the saved directory before its space
+  // can be rewritten
+  if (sampleRegion.remove(flashPath)) {
+    saveRegionState();
   }
 
-  // Write modified WAV header (convert to 16-bit mono)
-  header[22] = 1;
-  header[23] = 0;  // 1 channel
-  header[34] = 16;
-  header[35] = 0;  // 16 bits per sample
-  uint32_t newDataSize = dataSize / (bitsPerSample / 8) / numChannels *
-                         2;  // Convert to 16-bit mono
-  *(uint32_t*)(header + 40) = newDataSize;
-  *(uint32_t*)(header + 4) = newDataSize + 36;  // File size
+  // Claim a contiguous run of the sample region, closing up the gaps
+  // first if none is big enough on its own. Moved samples' old copies are
+  // reused straight away, so every voice stops first, and the directory
+  // is saved after each move.
+  if (!sampleRegion.create(flashPath, copyBytes)) {
+    bool compactable = sampleRegion.fragmented() &&
+                       sampleRegion.largestGap() < sampleRegion.freeBytes();
+    if (compactable && !mayCompact) {
+      sdFile.close();
+      return COPY_NEEDS_ROOM;
+    }
+    if (compactable) {
+      Serial.println("Compacting flash samples...");
+      for (int i = 0; i < Engine::channels; i++) stopChannel(i);
+      while (sampleRegion.fragmented()) {
+        if (sampleRegion.compactStep()) saveRegionState();
+      }
+    }
+    if (!sampleRegion.create(flashPath, copyBytes)) {
+      Serial.printf("No room in flash for %d bytes: %s\n", copyBytes,
+                    flashPath);
+      sdFile.close();
+      return COPY_FAILED;
+    }
+  }
+  sampleRegion.write(header, 44);
+
+  copy.active = true;
+  copy.sdFile = sdFile;
+  copy.bitsPerSample = bitsPerSample;
+  copy.numChannels = numChannels;
+  copy.totalSamples = totalSamples;
+  copy.samplesDone = 0;
+  copy.samplesRead = 0;
+  copy.peaks.begin(copy.overview, totalSamples);
+  snprintf(copy.flashPath, sizeof(copy.flashPath), "%s", flashPath);
+  return COPY_STARTED;
+}
 
-  flashFile.write(header, 44);
+// Convert and store up to FLASH_COPY_FRAMES more frames, collecting the
+// overview on the way. Returns true while there is more to copy.
+bool stepFlashCopy(FlashCopy& copy) {
+  // Up to 24-bit stereo frames in, 16-bit mono samples out
+  static uint8_t frames[FLASH_COPY_FRAMES * 6];
+  static int16_t samples[FLASH_COPY_FRAMES];
+
+  uint32_t frameBytes = copy.bitsPerSample / 8 * copy.numChannels;
+  uint32_t count = min((uint32_t)FLASH_COPY_FRAMES,
+                       copy.totalSamples - copy.samplesDone);
+  uint32_t readCount = 0;
+
+  // A short read leaves silence, so the data chunk matches its header and
+  // the overview lands where loadVariantHead() looks for it
+  if (copy.samplesRead == copy.samplesDone) {
+    int bytesRead = copy.sdFile.read(frames, count * frameBytes);
+    readCount = bytesRead > 0 ? bytesRead / frameBytes : 0;
+  }
 
-  // Copy and convert audio data
-  uint32_t samplesProcessed = 0;
-  uint32_t totalSamples = dataSize / (bitsPerSample / 8) / numChannels;
+  for (uint32_t i = 0; i < count; i++) {
+    if (i < readCount) {
+      samples[i] = decodeFrame(frames + i * frameBytes, copy.bitsPerSample,
+                               copy.numChannels);
+      copy.peaks.add(samples[i]);
+    } else {
+      samples[i] = 0;
+    }
+  }
 
-  while (samplesProcessed < totalSamples && sdFile.available()) {
-    int16_t outputSample = 0;
+  // Write 16-bit samples to flash
+  sampleRegion.write((const uint8_t*)samples, count * 2);
+  copy.samplesRead += readCount;
+  copy.samplesDone += count;
+  return copy.samplesDone < copy.totalSamples;
+}
 
-    if (bitsPerSample == 16) {
-      if (numChannels == 1) {
-        // 16-bit mono - direct copy
-        uint8_t bytes[2];
-        if (sdFile.read(bytes, 2) == 2) {
-          outputSample = (int16_t)(bytes[0] | (bytes[1] << 8));
-        }
-      } else {
-        // 16-bit stereo - mix to mono
-        uint8_t bytes[4];
-        if (sdFile.read(bytes, 4) == 4) {
-          int16_t left = (int16_t)(bytes[0] | (bytes[1] << 8));
-          int16_t right = (int16_t)(bytes[2] | (bytes[3] << 8));
-          outputSample = (left + right) / 2;
-        }
-      }
-    } else if (bitsPerSample == 24) {
-      if (numChannels == 1) {
-        // 24-bit mono - convert to 16-bit
-        uint8_t bytes[3];
-        if (sdFile.read(bytes, 3) == 3) {
-          int32_t sample24 =
-              (int32_t)(bytes[0] | (bytes[1] << 8) | (bytes[2] << 16));
-          if (sample24 & 0x800000) sample24 |= 0xFF000000;  // Sign extend
-          outputSample = sample24 >> 8;
-        }
-      } else {
-        // 24-bit stereo - mix to mono and convert to 16-bit
-        uint8_t bytes[6];
-        if (sdFile.read(bytes, 6) == 6) {
-          int32_t left24 =
-              (int32_t)(bytes[0] | (bytes[1] << 8) | (bytes[2] << 16));
-          int32_t right24 =
-              (int32_t)(bytes[3] | (bytes[4] << 8) | (bytes[5] << 16));
-          if (left24 & 0x800000) left24 |= 0xFF000000;
-          if (right24 & 0x800000) right24 |= 0xFF000000;
-          int32_t mixed = (left24 + right24) / 2;
-          outputSample = mixed >> 8;
-        }
-      }
-    }
+// Append the overview chunk and close the copy off. Returns false if it
+// couldn't be stored, leaving nothing behind.
+bool finishFlashCopy(FlashCopy& copy) {
+  if (!copy.active) return false;
+  copy.active = false;
+
+  uint8_t chunk[8];
+  memcpy(chunk, OVERVIEW_CHUNK_ID, 4);
+  *(uint32_t*)(chunk + 4) = sizeof(WaveformOverview);
+  sampleRegion.write(chunk, 8);
+  sampleRegion.write((const uint8_t*)&copy.overview, sizeof(copy.overview));
+
+  copy.sdFile.close();
+  if (!sampleRegion.finish()) {
+    Serial.printf("Failed to write flash sample: %s\n", copy.flashPath);
+    return false;
+  }
+  saveRegionState();
+
+  Serial.printf("Copied %d samples to flash: %s\n", copy.samplesRead,
+                copy.flashPath);
+  return true;
+}
+
+// Give up on a copy part way through; the sample was never saved, so
+// dropping it is enough
+void abortFlashCopy(FlashCopy& copy) {
+  if (!copy.active) return;
+  copy.active = false;
+  copy.sdFile.close();
+  sampleRegion.abort();
+}
 
-    // Write 16-bit sample to flash
-    uint8_t outputBytes[2] = {(uint8_t)(outputSample & 0xFF),
-                              (uint8_t)(outputSample >> 8)};
-    flashFile.write(outputBytes, 2);
+// One WAV frame as a 16-bit mono sample
+int16_t decodeFrame(const uint8_t* bytes, uint16_t bitsPerSample,
+                    uint16_t numChannels) {
+  if (bitsPerSample == 16) {
+    if (numChannels == 1) {
+      // 16-bit mono - direct copy
+      return (int16_t)(bytes[0] | (bytes[1] << 8));
+    }
+    // 16-bit stereo - mix to mono
+    int16_t left = (int16_t)(bytes[0] | (bytes[1] << 8));
+    int16_t right = (int16_t)(bytes[2] | (bytes[3] << 8));
+    return (left + right) / 2;
+  }
 
-    samplesProcessed++;
+  // 24-bit - convert to 16-bit
+  int32_t sample24 = (int32_t)(bytes[0] | (bytes[1] << 8) | (bytes[2] << 16));
+  if (sample24 & 0x800000) sample24 |= 0xFF000000;  // Sign extend
+  if (numChannels == 1) {
+    return sample24 >> 8;
   }
 
-  sdFile.close();
-  flashFile.close();
+  // 24-bit stereo - mix to mono and convert to 16-bit
+  int32_t right24 = (int32_t)(bytes[3] | (bytes[4] << 8) | (bytes[5] << 16));
+  if (right24 & 0x800000) right24 |= 0xFF000000;
+  int32_t mixed = (sample24 + right24) / 2;
+  return mixed >> 8;
+}
 
-  Serial.printf("Copied %d samples to flash: %s\n", samplesProcessed,
-                flashPath.c_str());
-  return true;
+// Fill in a 44-byte RIFF header for 16-bit mono PCM
+void buildWavHeader(uint8_t* header, uint32_t dataBytes, uint32_t sampleRate) {
+  memcpy(header, "RIFF", 4);
+  *(uint32_t*)(header + 4) = dataBytes + 36;  // File size
+  memcpy(header + 8, "WAVEfmt ", 8);
+  *(uint32_t*)(header + 16) = 16;              // fmt chunk size
+  *(uint16_t*)(header + 20) = 1;               // PCM
+  *(uint16_t*)(header + 22) = 1;               // 1 channel
+  *(uint32_t*)(header + 24) = sampleRate;
+  *(uint32_t*)(header + 28) = sampleRate * 2;  // Byte rate
+  *(uint16_t*)(header + 32) = 2;               // Block align
+  *(uint16_t*)(header + 34) = 16;              // 16 bits per sample
+  memcpy(header + 36, "data", 4);
+  *(uint32_t*)(header + 40) = dataBytes;
 }
 
-// Update button states with debouncing
+// Debounce every panel button from a single GPIO snapshot
 void updateButtons() {
+  static unsigned long lastScan = 0;
   unsigned long currentTime = millis();
+  if (currentTime - lastScan < BUTTON_SCAN_MS) return;
+  lastScan = currentTime;
 
-  // Update trigger buttons
-  for (int i = 0; i < 4; i++) {
-    bool reading = digitalRead(buttons[i].pin) == LOW;  // Active low
+  PanelButtons& panel = panelButtons;
+  uint32_t sample = gpio_get_all() & PANEL_INPUT_MASK;
+
+  // Count scans that disagree with the debounced state; agreeing resets
+  uint32_t delta = sample ^ panel.state;
+  panel.count1 = (panel.count1 ^ panel.count0) & delta;
+  panel.count0 = ~panel.count0 & delta;
+
+  // Counter wrapped back to zero: four disagreeing scans in a row
+  uint32_t toggled = delta & ~(panel.count0 | panel.count1);
+  panel.state ^= toggled;
+
+  // Active low: a press is a bit that toggled to 0
+  panel.pressed |= toggled & ~panel.state;
+  panel.released |= toggled & panel.state;
+}
+
+// Start the PIO trigger sampler and the DMA channel draining it
+void initializeTriggerCapture() {
+  PIO pio = pio0;
+  if (!pio_can_add_program(pio, &trigger_capture_program)) {
+    pio = pio1;
+  }
+  uint offset = pio_add_program(pio, &trigger_capture_program);
+  uint sm = pio_claim_unused_sm(pio, true);
+
+  // Copy every captured word into the ring, wrapping at its end
+  triggerDmaChannel = dma_claim_unused_channel(true);
+  dma_channel_config config =
+      dma_channel_get_default_config(triggerDmaChannel);
+  channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+  channel_config_set_read_increment(&config, false);
+  channel_config_set_write_increment(&config, true);
+  channel_config_set_ring(&config, true, __builtin_ctz(TRIGGER_RING_BYTES));
+  channel_config_set_dreq(&config, pio_get_dreq(pio, sm, false));
+  dma_channel_configure(triggerDmaChannel, &config, triggerRing,
+                        &pio->rxf[sm], 0xFFFFFFFF, true);
+
+  uint32_t div256 = trigger_capture_program_init(pio, sm, offset, BUTTON_1_PIN,
+                                                 TRIGGER_SAMPLE_RATE_HZ);
+  triggerAnchorUs = time_us_32();
+  triggerAnchorTicks = 0;
+  triggerAnchorRemainder = 0;
+
+  // Ticks per microsecond: clk_sys over the divider and the loop length
+  triggerTickNum = (uint64_t)clock_get_hz(clk_sys) * 256;
+  triggerTickDen =
+      (uint64_t)div256 * TRIGGER_CAPTURE_CYCLES_PER_SAMPLE * 1000000;
+
+  Serial.printf("Trigger capture on PIO%d SM%d, DMA %d, %luHz\n",
+                pio_get_index(pio), sm, triggerDmaChannel,
+                (unsigned long)(triggerTickNum * 1000000 / triggerTickDen));
+}
 
-    if (reading != buttons[i].lastState) {
-      buttons[i].lastDebounceTime = currentTime;
+// Carry the predicted capture count forward to nowUs. The counter and
+// time_us_32() both run off the crystal, so with the exact tick rate the
+// prediction stays within a tick of the counter however long it runs.
+// Called every pass, well inside the few minutes before the product
+// would overflow.
+void advanceCaptureAnchor(uint32_t nowUs) {
+  uint64_t scaled = (uint64_t)(nowUs - triggerAnchorUs) * triggerTickNum +
+                    triggerAnchorRemainder;
+  triggerAnchorTicks += (uint32_t)(scaled / triggerTickDen);
+  triggerAnchorRemainder = scaled % triggerTickDen;
+  triggerAnchorUs = nowUs;
+}
+
+// Convert a captured 28-bit down-count into time_us_32() time. Only its
+// age behind the anchor is needed to undo the 28-bit wrap; an edge a
+// rounding error newer than the anchor reads as the anchor itself.
+uint32_t captureTimestampUs(uint32_t count) {
+  uint32_t elapsed = (0u - count) & 0x0FFFFFFF;
+  uint32_t ageTicks = (triggerAnchorTicks - elapsed) & 0x0FFFFFFF;
+  if (ageTicks & 0x08000000) return triggerAnchorUs;
+  return triggerAnchorUs -
+         (uint32_t)(ageTicks * triggerTickDen / triggerTickNum);
+}
+
+// Start the CV ADC free-running into its DMA ring. Conversions are paced
+// by the ADC clock, so each slot's age follows from its distance behind
+// the DMA write pointer.
+void initializeCvInput() {
+#if CV_INPUT_MODE != CV_INPUT_NONE
+  adc_init();
+  adc_gpio_init(CV_ADC_PIN);
+  adc_select_input(CV_ADC_INPUT);
+  adc_fifo_setup(true, true, 1, false, false);
+  adc_set_clkdiv(48000000.0f / CV_SAMPLE_RATE_HZ - 1);
+
+  cvDmaChannel = dma_claim_unused_channel(true);
+  dma_channel_config config = dma_channel_get_default_config(cvDmaChannel);
+  channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+  channel_config_set_read_increment(&config, false);
+  channel_config_set_write_increment(&config, true);
+  channel_config_set_ring(&config, true, __builtin_ctz(CV_RING_BYTES));
+  channel_config_set_dreq(&config, DREQ_ADC);
+  dma_channel_configure(cvDmaChannel, &config, cvRing, &adc_hw->fifo,
+                        0xFFFFFFFF, true);
+  adc_run(true);
+
+  Serial.printf("CV input (%s) on GPIO%d (ADC%d), DMA %d\n",
+                CV_INPUT_MODE == CV_INPUT_ACCENT ? "accent" : "sample",
+                CV_ADC_PIN, CV_ADC_INPUT, cvDmaChannel);
+#endif
+}
+
+// 12-bit CV level just after a trigger edge, or 0 without a CV input
+uint16_t cvLevelAt(uint32_t edgeUs, uint32_t nowUs) {
+#if CV_INPUT_MODE != CV_INPUT_NONE
+  const uint32_t ringSamples = CV_RING_BYTES / 2;
+  const uint32_t periodUs = 1000000 / CV_SAMPLE_RATE_HZ;
+
+  // The newest slot was converted within the last period; step back from
+  // it to the settle point, or use it if that hasn't been reached yet
+  uint32_t writeAddress = dma_channel_hw_addr(cvDmaChannel)->write_addr;
+  uint32_t newest =
+      (writeAddress - (uint32_t)(uintptr_t)cvRing) / 2 + ringSamples - 1;
+  uint32_t settleUs = edgeUs + CV_SETTLE_US;
+  int32_t ageUs = (int32_t)(nowUs - settleUs);
+  uint32_t back = ageUs > 0 ? min((uint32_t)ageUs / periodUs, ringSamples - 1)
+                            : 0;
+  uint16_t level = cvRing[(newest - back) % ringSamples] & 0x0FFF;
+
+  // Rearm the transfer in the unlikely case it has run its full count
+  if (!dma_channel_is_busy(cvDmaChannel)) {
+    dma_channel_set_trans_count(cvDmaChannel, 0xFFFFFFFF, true);
+  }
+
+  return level;
+#else
+  (void)edgeUs;
+  (void)nowUs;
+  return 0;
+#endif
+}
+
+// Q15 velocity for a trigger edge. Without an accent input every hit
+// plays at full level.
+uint16_t accentVelocityAt(uint32_t edgeUs, uint32_t nowUs) {
+#if CV_INPUT_MODE == CV_INPUT_ACCENT
+  uint16_t level = cvLevelAt(edgeUs, nowUs);
+  return VELOCITY_FLOOR + ((level * (VELOCITY_UNITY - VELOCITY_FLOOR)) >> 12);
+#else
+  (void)edgeUs;
+  (void)nowUs;
+  return VELOCITY_UNITY;
+#endif
+}
+
+// Bank sample for a trigger edge: the CV level spread across the bank, or
+// a random pick when no sample CV input is fitted. -1 with an empty bank.
+int bankSlotAt(uint32_t edgeUs, uint32_t nowUs) {
+  if (sampleBank.count == 0) return -1;
+#if CV_INPUT_MODE == CV_INPUT_SAMPLE
+  return (cvLevelAt(edgeUs, nowUs) * sampleBank.count) >> 12;
+#else
+  (void)edgeUs;
+  (void)nowUs;
+  return rand() % sampleBank.count;
+#endif
+}
+
+// Play every trigger captured since the last pass
+void processTriggerEvents() {
+  uint32_t writeAddress = dma_channel_hw_addr(triggerDmaChannel)->write_addr;
+  uint32_t writeIndex =
+      (writeAddress - (uint32_t)(uintptr_t)triggerRing) / 4;
+  uint32_t now = time_us_32();
+  advanceCaptureAnchor(now);
+
+  while (triggerRingRead != writeIndex) {
+    uint32_t word = triggerRing[triggerRingRead];
+    triggerRingRead = (triggerRingRead + 1) % (TRIGGER_RING_BYTES / 4);
+
+    // Jacks are inverted by the input buffer, so a rising trigger voltage
+    // is a falling pin: fire on bits that went from 1 to 0
+    uint32_t pins = word & 0xF;
+    uint32_t fired = triggerPinState & ~pins;
+    uint32_t releasedPins = ~triggerPinState & pins;
+    triggerPinState = pins;
+
+    uint32_t edgeUs = captureTimestampUs(word >> 4);
+    for (int i = 0; i < Engine::channels; i++) {
+      if (releasedPins & (1u << i)) triggerInputs[i].releasedUs = edgeUs;
     }
+    if (!fired) continue;
 
-    if ((currentTime - buttons[i].lastDebounceTime) > DEBOUNCE_DELAY) {
-      if (reading != buttons[i].currentState) {
-        buttons[i].currentState = reading;
+    uint16_t velocity = accentVelocityAt(edgeUs, now);
 
-        if (buttons[i].currentState) {
-          buttons[i].triggered = true;
-        }
-      }
+    // Start every hit a fixed time after its edge rather than at the next
+    // block, so loop timing doesn't add jitter. An edge seen too late to
+    // make it starts at once.
+    const int64_t latency = TRIGGER_LATENCY_BLOCKS * Engine::blockFrames;
+    int64_t delay = (int64_t)(frameAtUs(edgeUs) - audioFrame) + latency;
+    uint32_t startDelay = (uint32_t)constrain(delay, (int64_t)0, latency);
+
+    int bankSlot = bankSlotAt(edgeUs, now);
+    for (int i = 0; i < Engine::channels; i++) {
+      if (!(fired & (1u << i))) continue;
+
+      // Glitch filter: edges this close together are ringing, not pulses
+      TriggerInput& input = triggerInputs[i];
+      if (edgeUs - input.lastEdgeUs < TRIGGER_HOLDOFF_US) continue;
+
+      // Switch bounce: the panel buttons share these pins and can't be
+      // told apart from the jacks, so an input only fires again once it
+      // has stayed released for TRIGGER_REARM_US. A bouncing contact
+      // never does; clean jack pulses always do.
+      if (edgeUs - input.releasedUs < TRIGGER_REARM_US) continue;
+      input.lastEdgeUs = edgeUs;
+
+      playHit(i, velocity, bankSlot, startDelay, triggerRatchets[i]);
+      lastTriggeredSample = i;
+      Serial.printf("Trigger %d (%s) after %luus, velocity %d%%\n", i + 1,
+                    input.name, (unsigned long)(now - edgeUs),
+                    velocity * 100 / VELOCITY_UNITY);
     }
+  }
+}
 
-    buttons[i].lastState = reading;
+// Process button triggers
+void processButtonTriggers() {
+  static unsigned long selectPressedAt = 0;
+
+  uint32_t pressed = panelButtons.pressed;
+  uint32_t released = panelButtons.released;
+  panelButtons.pressed = 0;
+  panelButtons.released = 0;
+
+  // Trigger buttons share pins with the jacks and are played by the PIO
+  // capture; only the navigation buttons act here
+  if (pressed & NAV_UP_MASK) {  // Up
+    selectMenuSample((currentMenuSample - 1 + Engine::channels) %
+                     Engine::channels);
   }
 
-  // Update navigation buttons
-  for (int i = 0; i < 3; i++) {
-    bool reading = digitalRead(navButtons[i].pin) == LOW;  // Active low
+  if (pressed & NAV_DOWN_MASK) {  // Down
+    selectMenuSample((currentMenuSample + 1) % Engine::channels);
+  }
+
+  // Select (button or encoder push) acts on release, so a long hold can
+  // switch step editing instead
+  if (pressed & NAV_SELECT_MASK) {
+    selectPressedAt = millis();
+  }
 
-    if (reading != navButtons[i].lastState) {
-      navButtons[i].lastDebounceTime = currentTime;
+  if (released & NAV_SELECT_MASK) {
+    displayDirty = true;
+    if (millis() - selectPressedAt >= LONG_PRESS_MS) {
+      toggleSequencerEditing();
+    } else if (sequencerEditing) {
+      sequencer.toggleStep(currentMenuSample, stepCursor);
+    } else {
+      loadSampleToFlash(currentMenuSample, browseSampleIndex);
     }
+  }
+}
 
-    if ((currentTime - navButtons[i].lastDebounceTime) > DEBOUNCE_DELAY) {
-      if (reading != navButtons[i].currentState) {
-        navButtons[i].currentState = reading;
+// Trigger every sequencer step due before the end of the block about to
+// be mixed, each delayed to its own frame within the block
+void runSequencer() {
+  SequencerStep step;
+  uint64_t blockEnd = audioFrame + Engine::blockFrames;
 
-        if (navButtons[i].currentState) {
-          navButtons[i].triggered = true;
-        }
-      }
+  while (sequencer.nextStep(blockEnd, step)) {
+    uint32_t offset = step.frame > audioFrame ? step.frame - audioFrame : 0;
+    uint32_t now = time_us_32();
+
+    for (int track = 0; track < SEQUENCER_TRACKS; track++) {
+      if (!(step.tracks & (1u << track))) continue;
+
+      uint16_t velocity =
+          step.accents & (1u << track) ? VELOCITY_UNITY : SEQUENCER_VELOCITY;
+      playHit(track, velocity, bankSlotAt(now, now), offset,
+              step.ratchets[track]);
     }
+  }
+}
 
-    navButtons[i].lastState = reading;
+// Start the sequencer from step 1 at the next block, or stop it
+void toggleSequencer() {
+  if (sequencer.running()) {
+    sequencer.stop();
+    Serial.println("Sequencer stopped");
+  } else if (clockSynced) {
+    // Start on the next clock pulse
+    clockBasePulse = clockTracker.pulse() + 1;
+    clockBaseStep = 0;
+    sequencer.start((clockTracker.phase() + clockTracker.period()) >> 16);
+    Serial.printf("Sequencer following clock at %d BPM\n", clockBpm());
+  } else {
+    sequencer.start(audioFrame);
+    Serial.printf("Sequencer running at %d BPM\n", sequencer.tempo());
   }
 }
 
-// Process button triggers
-void processButtonTriggers() {
-  // Process trigger buttons
-  for (int i = 0; i < 4; i++) {
-    if (buttons[i].triggered) {
-      buttons[i].triggered = false;
-      Serial.printf("Button %d (%s) triggered!\n", i + 1, buttons[i].name);
-      triggerSample(i);
-      lastTriggeredSample = i;
+// Clock input interrupt: timestamp the edge for loop() to pick up
+void onClockEdge() {
+  uint32_t now = time_us_32();
+  static uint32_t lastEdgeUs = 0;
+  if (now - lastEdgeUs < CLOCK_HOLDOFF_US) return;
+  lastEdgeUs = now;
+
+  clockEdges.push(now);  // Dropped if loop() has fallen 8 edges behind
+}
+
+// Fold the latest block into the microsecond to frame mapping
+void updateAudioClock() {
+  uint32_t now = time_us_32();
+  int64_t measuredQ8 = (int64_t)audioFrame << 8;
+
+  if (audioClockFrameQ8 < 0) {
+    audioClockFrameQ8 = measuredQ8;
+  } else {
+    int64_t elapsedQ8 =
+        ((int64_t)(now - audioClockUs) * Engine::sampleRate << 8) / 1000000;
+    int64_t predictedQ8 = audioClockFrameQ8 + elapsedQ8;
+    audioClockFrameQ8 = predictedQ8 + ((measuredQ8 - predictedQ8) >> 6);
+  }
+  audioClockUs = now;
+}
+
+// Audio frame at a recent time_us_32() timestamp
+uint64_t frameAtUs(uint32_t us) {
+  int32_t offsetUs = (int32_t)(us - audioClockUs);
+  int64_t offsetQ8 = ((int64_t)offsetUs * Engine::sampleRate << 8) / 1000000;
+  return (uint64_t)(audioClockFrameQ8 + offsetQ8) >> 8;
+}
+
+// Feed clock edges to the tracker and keep the sequencer on its grid
+void processClockEdges() {
+  uint32_t edgeUs;
+  while (clockEdges.pop(edgeUs)) {
+    if (clockTracker.edge(frameAtUs(edgeUs))) {
+      syncSequencerToClock();
+    } else if (clockSynced) {
+      clockSynced = false;
+      displayDirty = true;
+      Serial.println("Clock lost lock");
     }
   }
 
-  // Process navigation buttons
-  if (navButtons[0].triggered) {  // Up
-    navButtons[0].triggered = false;
-    currentMenuSample = (currentMenuSample - 1 + 4) % 4;
-    Serial.printf("Selected: %s\n",
-                  samplePlayers[currentMenuSample].folderName);
+  // Free-run at the last tempo once the clock stops
+  clockTracker.checkTimeout(audioFrame);
+  if (clockSynced && !clockTracker.locked()) {
+    clockSynced = false;
+    displayDirty = true;
+    Serial.println("Clock stopped, sequencer free-running");
+  }
+}
+
+// Move the step grid onto the clock's predicted pulses; steps between
+// pulses are spread evenly across the estimated period
+void syncSequencerToClock() {
+  if (!clockSynced) {
+    // Just locked: the next pulse carries the next step to play
+    clockBasePulse = clockTracker.pulse() + 1;
+    clockBaseStep = sequencer.stepsTaken();
+    clockSynced = true;
+    Serial.printf("Clock locked at %d BPM\n", clockBpm());
+  }
+
+  int32_t pulses = (int32_t)(clockTracker.pulse() - clockBasePulse);
+  uint32_t baseStep = clockBaseStep + pulses * CLOCK_STEPS_PER_PULSE;
+  sequencer.retime(clockTracker.phase(), baseStep,
+                   clockTracker.period() / CLOCK_STEPS_PER_PULSE);
+
+  // The step editor shows the clock's tempo
+  uint16_t bpm = clockBpm();
+  if (bpm != shownClockBpm) {
+    shownClockBpm = bpm;
+    displayDirty = true;
+  }
+}
+
+// Tempo of the tracked clock
+uint16_t clockBpm() {
+  uint64_t framesPerStepQ16 = clockTracker.period() / CLOCK_STEPS_PER_PULSE;
+  return ((uint64_t)Engine::sampleRate * 60 << 16) /
+         (framesPerStepQ16 * SEQUENCER_STEPS_PER_BEAT);
+}
+
+// Switch the encoder and select between sample browsing and step editing,
+// saving the pattern when editing ends
+void toggleSequencerEditing() {
+  sequencerEditing = !sequencerEditing;
+  Serial.printf("Step edit %s\n", sequencerEditing ? "on" : "off");
+  if (!sequencerEditing) {
+    saveSequencerState();
   }
+}
+
+// Move the step editor's cursor, wrapping within the pattern length
+void moveStepCursor(int steps) {
+  int length = sequencer.current().length;
+  stepCursor = ((stepCursor + steps) % length + length) % length;
+  displayDirty = true;
+}
+
+void changeTempo(int delta) {
+  sequencer.setTempo(sequencer.tempo() + delta);
+  Serial.printf("Tempo: %d BPM\n", sequencer.tempo());
+  saveSequencerState();
+}
+
+// Persist the pattern and tempo
+void saveSequencerState() {
+  if (!flashWorking) return;
+
+  SequencerStateRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = SEQUENCER_STATE_MAGIC;
+  record.pattern = sequencer.current();
+  record.checksum =
+      fnvChecksum(&record, offsetof(SequencerStateRecord, checksum));
+
+  File file = LittleFS.open(SEQUENCER_STATE_PATH, "w");
+  if (!file || file.write((const uint8_t*)&record, sizeof(record)) !=
+                   sizeof(record)) {
+    Serial.println("Failed to save pattern");
+  }
+  if (file) file.close();
+}
+
+bool restoreSequencerState() {
+  if (!flashWorking) return false;
+
+  File file = LittleFS.open(SEQUENCER_STATE_PATH, "r");
+  if (!file) return false;
+
+  SequencerStateRecord record;
+  size_t bytesRead = file.read((uint8_t*)&record, sizeof(record));
+  file.close();
 
-  if (navButtons[1].triggered) {  // Down
-    navButtons[1].triggered = false;
-    currentMenuSample = (currentMenuSample + 1) % 4;
-    Serial.printf("Selected: %s\n",
-                  samplePlayers[currentMenuSample].folderName);
+  if (bytesRead != sizeof(record) || record.magic != SEQUENCER_STATE_MAGIC ||
+      record.checksum !=
+          fnvChecksum(&record, offsetof(SequencerStateRecord, checksum))) {
+    return false;
   }
 
-  if (navButtons[2].triggered) {  // Select
-    navButtons[2].triggered = false;
-    if (samplePlayers[currentMenuSample].totalSamples > 0) {
-      int nextIndex =
-          (samplePlayers[currentMenuSample].currentSampleIndex + 1) %
-          samplePlayers[currentMenuSample].totalSamples;
-      loadSampleToFlash(currentMenuSample, nextIndex);
+  sequencer.load(record.pattern);
+  Serial.printf("Restored pattern: %d steps at %d BPM\n",
+                sequencer.current().length, sequencer.tempo());
+  return true;
+}
+
+// Start the PIO quadrature decoder. Its jump table has to sit at offset 0,
+// so it takes whichever PIO still has that space free.
+void initializeEncoder() {
+  PIO pio = pio0;
+  if (!pio_can_add_program_at_offset(pio, &quadrature_encoder_program, 0)) {
+    pio = pio1;
+    if (!pio_can_add_program_at_offset(pio, &quadrature_encoder_program, 0)) {
+      Serial.println("No PIO space for the encoder - browse with buttons");
+      return;
     }
   }
+  int sm = pio_claim_unused_sm(pio, false);
+  if (sm < 0) {
+    Serial.println("No PIO state machine for the encoder");
+    return;
+  }
+
+  pio_add_program_at_offset(pio, &quadrature_encoder_program, 0);
+  quadrature_encoder_program_init(pio, sm, ENCODER_A_PIN,
+                                  ENCODER_MAX_STEP_RATE);
+  encoder.pio = pio;
+  encoder.sm = sm;
+
+  Serial.printf("Encoder on GPIO%d/%d, PIO%d SM%d\n", ENCODER_A_PIN,
+                ENCODER_B_PIN, pio_get_index(pio), sm);
+}
+
+// Read the encoder count at control rate and move the browse cursor,
+// taking bigger steps the faster the knob is turned
+void serviceEncoder() {
+  static unsigned long lastPoll = 0;
+  if (!encoder.pio || millis() - lastPoll < ENCODER_POLL_MS) return;
+  lastPoll = millis();
+
+  // Whole detents since the last read; part-turns carry over
+  int32_t count = quadrature_encoder_get_count(encoder.pio, encoder.sm);
+  int32_t detents = (count - encoder.consumedCount) / ENCODER_COUNTS_PER_DETENT;
+  if (detents == 0) return;
+  encoder.consumedCount += detents * ENCODER_COUNTS_PER_DETENT;
+
+  unsigned long interval = (lastPoll - encoder.lastMoveMs) / abs(detents);
+  encoder.lastMoveMs = lastPoll;
+
+  int stepsPerDetent = 1;
+  if (interval < ENCODER_FAST_MS) {
+    stepsPerDetent = 8;
+  } else if (interval < ENCODER_MEDIUM_MS) {
+    stepsPerDetent = 3;
+  }
+
+  if (sequencerEditing) {
+    moveStepCursor(detents);
+  } else {
+    moveBrowseCursor(detents * stepsPerDetent);
+  }
+}
+
+// Switch the menu to another channel
+void selectMenuSample(int menuSample) {
+  currentMenuSample = menuSample;
+  displayDirty = true;
+  Serial.printf("Selected: %s\n", samplePlayers[currentMenuSample].folderName);
+  resetBrowseCursor();
+}
+
+// Move the browse cursor through the current folder, wrapping at the ends
+void moveBrowseCursor(int steps) {
+  SamplePlayer& player = samplePlayers[currentMenuSample];
+  if (player.totalSamples == 0) return;
+
+  int total = player.totalSamples;
+  browseSampleIndex = ((browseSampleIndex + steps) % total + total) % total;
+
+  SampleIndexEntry entry;
+  if (player.index.lookup(browseSampleIndex, entry)) {
+    snprintf(browseName, sizeof(browseName), "%s", entry.name);
+  } else {
+    browseName[0] = '\0';
+  }
+  displayDirty = true;
+  Serial.printf("Browse %s %d/%d: %s\n", player.folderName,
+                browseSampleIndex + 1, player.totalSamples, browseName);
+}
+
+// Point the browse cursor at the sample after the loaded one, so select
+// without turning steps through the folder as before
+void resetBrowseCursor() {
+  browseSampleIndex = samplePlayers[currentMenuSample].currentSampleIndex;
+  browseName[0] = '\0';
+  moveBrowseCursor(1);
+}
+
+// Step editor: the current track's pattern with the cursor beneath it
+void updateSequencerDisplay() {
+  const SequencerPattern& pattern = sequencer.current();
+  display.printf("SEQ %s %d%s %s", samplePlayers[currentMenuSample].folderName,
+                 clockSynced ? clockBpm() : pattern.bpm,
+                 clockSynced ? "ext" : "bpm",
+                 sequencer.running() ? "RUN" : "STOP");
+
+  // x = hit, X = accented hit, 2-8 = ratcheted hit, . = rest
+  uint16_t steps = pattern.steps[currentMenuSample];
+  uint16_t accents = pattern.accents[currentMenuSample];
+  display.setCursor(0, 8);
+  for (int step = 0; step < pattern.length; step++) {
+    uint16_t bit = 1u << step;
+    int hits = sequencer.ratchet(currentMenuSample, step);
+    if (!(steps & bit)) {
+      display.print('.');
+    } else if (hits > 1) {
+      display.print((char)('0' + hits));
+    } else {
+      display.print(accents & bit ? 'X' : 'x');
+    }
+  }
+
+  display.setCursor(stepCursor * 6, 16);
+  display.print('^');
+
+  display.setCursor(0, 24);
+  display.printf("Step %d/%d swing %d%%", stepCursor + 1, pattern.length,
+                 pattern.swing);
 }
 
 // Update OLED display
@@ -818,20 +2844,50 @@ void updateDisplay() {
   display.setTextColor(SSD1306_WHITE);
   display.setCursor(0, 0);
 
-  // Title
-  display.println("Flash Streaming");
+  if (sequencerEditing) {
+    updateSequencerDisplay();
+    pushDisplay();
+    return;
+  }
 
-  // Show current sample info
-  if (samplePlayers[currentMenuSample].stream.loaded) {
-    display.printf("%s: %s\n", samplePlayers[currentMenuSample].folderName,
-                   samplePlayers[currentMenuSample].stream.filename.c_str());
+  if (meterView) {
+    updateMeterDisplay();
+    pushDisplay();
+    return;
+  }
 
-    float duration =
-        (float)samplePlayers[currentMenuSample].stream.totalSamples /
-        SAMPLE_RATE;
+  // Browse cursor once the folder is indexed, otherwise the title
+  if (samplePlayers[currentMenuSample].totalSamples > 0) {
+    display.printf("> %d/%d %s", browseSampleIndex + 1,
+                   samplePlayers[currentMenuSample].totalSamples, browseName);
+  } else {
+    display.print("Flash Streaming");
+  }
+
+  // Show current sample info (the most recently loaded variant)
+  display.setCursor(0, 8);
+  const SamplePlayer& player = samplePlayers[currentMenuSample];
+  if (player.variantCount > 0) {
+    const SampleVariant& variant = player.variants[player.variantCount - 1];
+    display.printf("%s: %s", player.folderName, variant.filename);
+
+    display.setCursor(0, 16);
+
+    float duration = (float)variant.totalSamples / Engine::sampleRate;
     display.printf("%.1fs", duration);
 
-    if (samplePlayers[currentMenuSample].stream.playing) {
+    if (player.variantCount > 1) {
+      display.printf(" x%d %s", player.variantCount,
+                     player.variantMode == VARIANT_VELOCITY ? "VEL" : "RR");
+    }
+    if (currentMenuSample == sampleBank.channel) {
+      display.printf(" CV%d", sampleBank.count);
+    }
+    if (triggerRatchets[currentMenuSample] > 1) {
+      display.printf(" R%d", triggerRatchets[currentMenuSample]);
+    }
+
+    if (channelPlaying(currentMenuSample)) {
       display.print(" PLAYING");
     }
   } else {
@@ -839,9 +2895,104 @@ void updateDisplay() {
                    samplePlayers[currentMenuSample].folderName);
   }
 
-  // Show memory usage
-  display.setCursor(0, 24);
-  display.printf("Free: %dKB", rp2040.getFreeHeap() / 1024);
+  // Waveform of the loaded sample along the bottom row
+  if (player.variantCount > 0) {
+    drawOverview(player.variants[player.variantCount - 1].overview, 24);
+  }
+
+  pushDisplay();
+}
 
-  display.display();
+// Let the meters fall at control rate, and redraw the meter view only
+// when a bar would change height
+void updateLevelMeters() {
+  static unsigned long lastDecay = 0;
+  if (millis() - lastDecay < METER_DECAY_MS) return;
+  lastDecay = millis();
+
+  // CLIP lights on a new clip and goes out once the hold time has passed
+  static uint32_t clipsSeen = 0;
+  static bool clipLit = false;
+  if (levelMeters.clippedSamples != clipsSeen) {
+    clipsSeen = levelMeters.clippedSamples;
+    levelMeters.lastClipMs = lastDecay;
+  }
+  bool lit = clipsSeen > 0 &&
+             lastDecay - levelMeters.lastClipMs < METER_CLIP_HOLD_MS;
+  if (lit != clipLit || lastDecay == levelMeters.lastClipMs) {
+    clipLit = lit;
+    if (meterView) displayDirty = true;
+  }
+
+  for (int i = 0; i <= Engine::voices; i++) {
+    uint32_t& peak =
+        i < Engine::voices ? levelMeters.voicePeak[i] : levelMeters.masterPeak;
+    uint8_t height = meterHeight(peak);
+    if (height != levelMeters.shown[i]) {
+      levelMeters.shown[i] = height;
+      if (meterView) displayDirty = true;
+    }
+    peak -= peak >> 2;
+  }
+}
+
+// Bar height for a peak level: four steps per doubling (~1.5dB), with
+// the top of the bar at full scale
+int meterHeight(uint32_t peak) {
+  peak = min(peak, (uint32_t)32767);
+  if (peak == 0) return 0;
+
+  int bits = 31 - __builtin_clz(peak);
+  int fraction = bits >= 2 ? (peak >> (bits - 2)) & 3 : 0;
+  int steps = bits * 4 + fraction + 1;  // 1-60
+  return constrain(steps - (60 - METER_HEIGHT), 0, METER_HEIGHT);
+}
+
+// Meter view: a bar per voice, then the master bar, under the clip count
+void updateMeterDisplay() {
+  display.printf("LEVELS %d clips", levelMeters.clippedSamples);
+  if (millis() - levelMeters.lastClipMs < METER_CLIP_HOLD_MS &&
+      levelMeters.clippedSamples > 0) {
+    display.print(" CLIP");
+  }
+
+  const int pitch = SCREEN_WIDTH / (Engine::voices + 1);
+  for (int i = 0; i <= Engine::voices; i++) {
+    int height = levelMeters.shown[i];
+    int x = i * pitch;
+    display.fillRect(x, SCREEN_HEIGHT - height, pitch - 2, height,
+                     SSD1306_WHITE);
+  }
+}
+
+// Draw an overview 8 pixels high with its top row at `top`: one vertical
+// line per column from the lowest level to the highest
+void drawOverview(const WaveformOverview& overview, int top) {
+  for (int x = 0; x < OVERVIEW_COLUMNS && x < SCREEN_WIDTH; x++) {
+    int high = overview.high[x] >> 5;  // -4..3
+    int low = overview.low[x] >> 5;
+    display.drawFastVLine(x, top + 3 - high, high - low + 1, SSD1306_WHITE);
+  }
+}
+
+// Send an overview to the serial port for host tools: the filename, the
+// column count, then each column's low and high level as signed bytes in
+// hex
+void printOverview(const SampleVariant& variant) {
+  Serial.printf("ovw %s %d ", variant.filename, OVERVIEW_COLUMNS);
+  for (int x = 0; x < OVERVIEW_COLUMNS; x++) {
+    Serial.printf("%02x%02x", (uint8_t)variant.overview.low[x],
+                  (uint8_t)variant.overview.high[x]);
+  }
+  Serial.println();
+}
+
+// Queue the drawn frame for the DMA push, or send it the slow way
+void pushDisplay() {
+  if (oledPush.ready()) {
+    oledPush.request();
+    oledPush.service();
+  } else {
+    display.display();
+  }
 }
@@ -0,0 +1,138 @@
+/**
+ * OLED Push
+ * Sends an SSD1306 framebuffer over I2C by DMA, a page at a time, and only
+ * the pages that changed since the last push. Drawing still goes through
+ * the Adafruit library's buffer; this replaces its blocking display()
+ * call so the audio loop never waits on the bus.
+ */
+
+#ifndef OLED_PUSH_H
+#define OLED_PUSH_H
+
+#include <Arduino.h>
+#include <hardware/dma.h>
+#include <hardware/i2c.h>
+
+#define OLED_PAGE_BYTES 128  // One page: 8 pixel rows across 128 columns
+#define OLED_MAX_PAGES 4     // 128x32 panel
+
+// Each byte on the bus is a 16-bit IC_DATA_CMD write: the data plus the
+// STOP flag that ends its transaction
+#define OLED_PAGE_COMMANDS 7  // Control byte, page and column windows
+#define OLED_PAGE_WORDS (OLED_PAGE_COMMANDS + 1 + OLED_PAGE_BYTES)
+
+class OledPush {
+ public:
+  // Take over an I2C block the display was set up on. Returns false if no
+  // DMA channel is free.
+  bool begin(i2c_inst_t* bus, uint8_t address, const uint8_t* frame,
+             int pages) {
+    i2c = bus;
+    framebuffer = frame;
+    framePages = min(pages, OLED_MAX_PAGES);
+    invalidate();
+
+    int channel = dma_claim_unused_channel(false);
+    if (channel < 0) return false;
+    dmaChannel = channel;
+
+    i2c_hw_t* hw = i2c_get_hw(i2c);
+    hw->enable = 0;
+    hw->tar = address;
+    hw->dma_cr = I2C_IC_DMA_CR_TDMAE_BITS;
+    hw->enable = 1;
+
+    dma_channel_config config = dma_channel_get_default_config(dmaChannel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, i2c_get_dreq(i2c, true));
+    dma_channel_configure(dmaChannel, &config, &hw->data_cmd, words, 0,
+                          false);
+    return true;
+  }
+
+  bool ready() const { return dmaChannel >= 0; }
+  bool busy() const { return ready() && dma_channel_is_busy(dmaChannel); }
+
+  // Ask for the framebuffer to go out once the bus is free
+  void request() { pending = true; }
+
+  // Start sending the changed pages if a push is pending and the last one
+  // has finished. Returns true if a transfer was started.
+  bool service() {
+    if (!pending || busy()) return false;
+
+    // A NAK mid-transfer flushes the rest: resend the whole frame
+    i2c_hw_t* hw = i2c_get_hw(i2c);
+    if (hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS) {
+      (void)hw->clr_tx_abrt;
+      aborts++;
+      invalidate();
+    }
+
+    uint32_t count = 0;
+    for (int page = 0; page < framePages; page++) {
+      const uint8_t* data = framebuffer + page * OLED_PAGE_BYTES;
+      uint8_t* sent = shadow + page * OLED_PAGE_BYTES;
+      if (!(stalePages & (1u << page)) &&
+          memcmp(data, sent, OLED_PAGE_BYTES) == 0) {
+        continue;
+      }
+
+      memcpy(sent, data, OLED_PAGE_BYTES);
+      count = addPage(count, page, data);
+      pagesSent++;
+    }
+
+    pending = false;
+    stalePages = 0;
+    if (count == 0) return false;
+
+    dma_channel_transfer_from_buffer_now(dmaChannel, words, count);
+    pushes++;
+    return true;
+  }
+
+  // Forget what the panel shows so the next push sends every page
+  void invalidate() { stalePages = (1u << framePages) - 1; }
+
+  uint32_t pushCount() const { return pushes; }
+  uint32_t pagesPushed() const { return pagesSent; }
+  uint32_t abortCount() const { return aborts; }
+
+ private:
+  // Queue the window commands and data for one page after `at` words
+  uint32_t addPage(uint32_t at, int page, const uint8_t* data) {
+    words[at++] = 0x00;  // Control byte: commands follow
+    words[at++] = 0x22;  // Page window
+    words[at++] = page;
+    words[at++] = page;
+    words[at++] = 0x21;  // Column window
+    words[at++] = 0;
+    words[at++] = (OLED_PAGE_BYTES - 1) | I2C_IC_DATA_CMD_STOP_BITS;
+
+    words[at++] = 0x40;  // Control byte: display data follows
+    for (int i = 0; i < OLED_PAGE_BYTES; i++) {
+      words[at++] = data[i];
+    }
+    words[at - 1] |= I2C_IC_DATA_CMD_STOP_BITS;
+    return at;
+  }
+
+  i2c_inst_t* i2c = nullptr;
+  const uint8_t* framebuffer = nullptr;
+  int framePages = 0;
+  int dmaChannel = -1;
+  bool pending = false;
+  uint8_t stalePages = 0;  // Pages to send even if they look unchanged
+
+  uint8_t shadow[OLED_MAX_PAGES * OLED_PAGE_BYTES];  // What the panel shows
+  uint16_t words[OLED_MAX_PAGES * OLED_PAGE_WORDS];  // IC_DATA_CMD stream
+
+  uint32_t pushes = 0;
+  uint32_t pagesSent = 0;
+  uint32_t aborts = 0;
+};
+
+#endif  // OLED_PUSH_H
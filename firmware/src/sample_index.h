@@ -0,0 +1,284 @@
+/**
+ * Sample Index
+ * Per-folder index of the SD card's WAV files, stored as fixed-size
+ * records in a hidden file so any sample can be looked up with one seek.
+ * The index is checked against the directory and rewritten only when the
+ * folder's contents change, reusing records for files that didn't.
+ */
+
+#ifndef SAMPLE_INDEX_H
+#define SAMPLE_INDEX_H
+
+#include <Arduino.h>
+#include <SD.h>
+
+#define SAMPLE_INDEX_NAME_LEN 48  // Longest indexed filename, including NUL
+#define SAMPLE_INDEX_FILE ".samples.idx"
+#define SAMPLE_INDEX_TEMP_FILE ".samples.tmp"
+#define SAMPLE_INDEX_MAGIC 0x58444953  // "SIDX"
+#define SAMPLE_INDEX_VERSION 1
+
+// One indexed WAV file
+struct SampleIndexEntry {
+  char name[SAMPLE_INDEX_NAME_LEN];
+  uint32_t fileBytes;    // Size of the WAV file on SD
+  uint32_t dataOffset;   // Byte offset of the PCM data chunk
+  uint32_t dataBytes;    // Size of the PCM data chunk
+  uint32_t sampleRate;
+  uint16_t channels;
+  uint16_t bitsPerSample;
+};
+
+// Written after the records so the file can be built append-only
+struct SampleIndexTrailer {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t entrySize;
+  uint32_t entryCount;
+  uint32_t signature;  // Hash of the WAV names and sizes that were indexed
+};
+
+class SampleFolderIndex {
+ public:
+  // Open the folder's existing index for lookups, without walking the
+  // directory. Returns false (and count() == 0) if there is none yet.
+  bool open(const char* folderPath) {
+    close();
+    if (folderPath != folder) {
+      snprintf(folder, sizeof(folder), "%s", folderPath);
+    }
+
+    char path[96];
+    makePath(path, sizeof(path), SAMPLE_INDEX_FILE);
+    indexFile = SD.open(path);
+    if (!indexFile) return false;
+
+    SampleIndexTrailer trailer;
+    if (indexFile.size() < sizeof(trailer) ||
+        !indexFile.seek(indexFile.size() - sizeof(trailer)) ||
+        indexFile.read((uint8_t*)&trailer, sizeof(trailer)) !=
+            sizeof(trailer) ||
+        trailer.magic != SAMPLE_INDEX_MAGIC ||
+        trailer.version != SAMPLE_INDEX_VERSION ||
+        trailer.entrySize != sizeof(SampleIndexEntry) ||
+        (uint64_t)trailer.entryCount * sizeof(SampleIndexEntry) +
+                sizeof(trailer) !=
+            indexFile.size()) {
+      indexFile.close();
+      return false;
+    }
+
+    entryCount = trailer.entryCount;
+    signature = trailer.signature;
+    return true;
+  }
+
+  void close() {
+    if (indexFile) indexFile.close();
+    if (dir) dir.close();
+    if (tempFile) tempFile.close();
+    entryCount = 0;
+    signature = 0;
+    phase = SYNC_IDLE;
+  }
+
+  uint32_t count() const { return entryCount; }
+
+  // O(1) lookup of the index-th sample in the folder
+  bool lookup(uint32_t index, SampleIndexEntry& entry) {
+    if (index >= entryCount || !indexFile) return false;
+    if (!indexFile.seek(index * sizeof(SampleIndexEntry))) return false;
+    return indexFile.read((uint8_t*)&entry, sizeof(entry)) == sizeof(entry);
+  }
+
+  // Start checking the index against the directory. Work is done in
+  // bounded slices by syncStep() so callers can spread it out.
+  void beginSync() {
+    if (dir) dir.close();
+    dir = SD.open(folder);
+    if (!dir || !dir.isDirectory()) {
+      if (dir) dir.close();
+      phase = SYNC_IDLE;
+      return;
+    }
+
+    walkSignature = FNV_OFFSET;
+    phase = SYNC_VERIFY;
+  }
+
+  // Visit up to maxFiles directory entries. Returns true once the index
+  // matches the directory (or the folder can't be read).
+  bool syncStep(uint32_t maxFiles) {
+    for (uint32_t visited = 0; visited < maxFiles && phase != SYNC_IDLE;
+         visited++) {
+      File file = dir.openNextFile();
+      if (!file) {
+        finishWalk();
+        continue;
+      }
+
+      if (!file.isDirectory() && isIndexable(file.name())) {
+        hashEntry(file.name(), file.size());
+        if (phase == SYNC_REBUILD) {
+          indexFileEntry(file);
+        }
+      }
+      file.close();
+    }
+
+    return phase == SYNC_IDLE;
+  }
+
+  bool syncing() const { return phase != SYNC_IDLE; }
+  uint32_t rebuildCount() const { return rebuilds; }
+  uint32_t reusedEntryCount() const { return reusedEntries; }
+
+  // Filenames the index accepts: visible .wav files that fit a record
+  static bool isIndexable(const char* name) {
+    size_t length = strlen(name);
+    return name[0] != '.' && length >= 4 &&
+           length < SAMPLE_INDEX_NAME_LEN &&
+           strcasecmp(name + length - 4, ".wav") == 0;
+  }
+
+  // Locate the fmt and data chunks of a RIFF/WAVE file
+  static bool parseWavHeader(File& file, SampleIndexEntry& entry) {
+    uint8_t riff[12];
+    if (!file.seek(0) || file.read(riff, 12) != 12 ||
+        memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+      return false;
+    }
+
+    bool haveFormat = false;
+    uint32_t position = 12;
+    for (int chunk = 0; chunk < 16; chunk++) {
+      uint8_t chunkHeader[8];
+      if (!file.seek(position) || file.read(chunkHeader, 8) != 8) break;
+      uint32_t chunkSize = *(uint32_t*)(chunkHeader + 4);
+
+      if (memcmp(chunkHeader, "fmt ", 4) == 0) {
+        uint8_t format[16];
+        if (chunkSize < 16 || file.read(format, 16) != 16) return false;
+        entry.channels = *(uint16_t*)(format + 2);
+        entry.sampleRate = *(uint32_t*)(format + 4);
+        entry.bitsPerSample = *(uint16_t*)(format + 14);
+        haveFormat = true;
+      } else if (memcmp(chunkHeader, "data", 4) == 0) {
+        entry.dataOffset = position + 8;
+        entry.dataBytes = min(chunkSize, (uint32_t)file.size() - position - 8);
+        return haveFormat;
+      }
+
+      // Chunks are padded to an even size
+      position += 8 + chunkSize + (chunkSize & 1);
+    }
+
+    return false;
+  }
+
+ private:
+  enum SyncPhase { SYNC_IDLE, SYNC_VERIFY, SYNC_REBUILD };
+
+  static const uint32_t FNV_OFFSET = 2166136261u;
+  static const uint32_t FNV_PRIME = 16777619u;
+
+  void makePath(char* path, size_t size, const char* name) const {
+    snprintf(path, size, "%s/%s", folder, name);
+  }
+
+  // Fold a directory entry into the listing signature (FNV-1a)
+  void hashEntry(const char* name, uint32_t size) {
+    for (const char* c = name; *c; c++) {
+      walkSignature = (walkSignature ^ (uint8_t)*c) * FNV_PRIME;
+    }
+    for (int shift = 0; shift < 32; shift += 8) {
+      walkSignature = (walkSignature ^ ((size >> shift) & 0xFF)) * FNV_PRIME;
+    }
+  }
+
+  void finishWalk() {
+    dir.close();
+
+    if (phase == SYNC_VERIFY) {
+      if (indexFile && walkSignature == signature) {
+        phase = SYNC_IDLE;
+        return;
+      }
+
+      // Listing changed: walk again, writing a fresh index beside the old one
+      char path[96];
+      makePath(path, sizeof(path), SAMPLE_INDEX_TEMP_FILE);
+      SD.remove(path);
+      tempFile = SD.open(path, FILE_WRITE);
+      dir = SD.open(folder);
+      if (!tempFile || !dir) {
+        // Keep serving the old index
+        if (tempFile) tempFile.close();
+        if (dir) dir.close();
+        phase = SYNC_IDLE;
+        return;
+      }
+
+      newCount = 0;
+      walkSignature = FNV_OFFSET;
+      phase = SYNC_REBUILD;
+      return;
+    }
+
+    // Rebuild finished: seal the new index and swap it in
+    SampleIndexTrailer trailer = {SAMPLE_INDEX_MAGIC, SAMPLE_INDEX_VERSION,
+                                  sizeof(SampleIndexEntry), newCount,
+                                  walkSignature};
+    tempFile.write((const uint8_t*)&trailer, sizeof(trailer));
+    tempFile.close();
+    if (indexFile) indexFile.close();
+
+    char indexPath[96];
+    char tempPath[96];
+    makePath(indexPath, sizeof(indexPath), SAMPLE_INDEX_FILE);
+    makePath(tempPath, sizeof(tempPath), SAMPLE_INDEX_TEMP_FILE);
+    SD.remove(indexPath);
+    SD.rename(tempPath, indexPath);
+
+    rebuilds++;
+    phase = SYNC_IDLE;
+    open(folder);
+  }
+
+  // Add one WAV file to the index being rebuilt, reusing the old record
+  // when the file at the same position is unchanged
+  void indexFileEntry(File& file) {
+    SampleIndexEntry entry;
+    uint32_t position = newCount;
+
+    if (lookup(position, entry) && entry.fileBytes == file.size() &&
+        strcmp(entry.name, file.name()) == 0) {
+      reusedEntries++;
+    } else {
+      memset(&entry, 0, sizeof(entry));
+      snprintf(entry.name, sizeof(entry.name), "%s", file.name());
+      entry.fileBytes = file.size();
+      if (!parseWavHeader(file, entry)) return;
+    }
+
+    tempFile.write((const uint8_t*)&entry, sizeof(entry));
+    newCount++;
+  }
+
+  char folder[32] = "";
+  File indexFile;
+  File dir;
+  File tempFile;
+  SyncPhase phase = SYNC_IDLE;
+
+  uint32_t entryCount = 0;
+  uint32_t signature = 0;
+
+  uint32_t walkSignature = 0;
+  uint32_t newCount = 0;
+
+  uint32_t rebuilds = 0;
+  uint32_t reusedEntries = 0;
+};
+
+#endif  // SAMPLE_INDEX_H
@@ -0,0 +1,450 @@
+/**
+ * Sample Region
+ * Raw flash set aside for sample copies, outside the filesystem. Each
+ * sample occupies one run of whole sectors, so it reads as a plain array
+ * through the XIP window and streaming never walks filesystem metadata.
+ * Gaps left by removed samples are closed up by compaction, which copies
+ * a sample down into a gap that holds all of it, a sector at a time.
+ *
+ * Power can go at any moment, so sectors the saved directory names are
+ * never erased: a move leaves its source intact and readable until it is
+ * complete, and callers save the directory after every change before the
+ * freed space is written. Checksums are checked in the background rather
+ * than at boot, so samples play as soon as the directory is restored.
+ *
+ * Flash can't be read while it is erased or programmed, so each erase and
+ * program runs with interrupts off. An erase takes tens of milliseconds;
+ * callers keep compaction, and eraseAhead() for samples stored in the
+ * background, to times when nothing is playing.
+ */
+
+#ifndef SAMPLE_REGION_H
+#define SAMPLE_REGION_H
+
+#include <Arduino.h>
+#include <hardware/flash.h>
+#include <hardware/regs/addressmap.h>
+
+#define REGION_SECTOR_BYTES ((uint32_t)FLASH_SECTOR_SIZE)  // Erase unit, 4KB
+#define REGION_PAGE_BYTES ((uint32_t)FLASH_PAGE_SIZE)  // Program unit, 256B
+#define REGION_HASH_SEED 2166136261u  // FNV-1a offset basis
+
+template <int MaxSamples, int PathLength>
+class SampleRegion {
+ public:
+  // One sample's run of sectors
+  struct Extent {
+    char path[PathLength];  // Name the sample is looked up by
+    uint32_t offset;        // From the start of the region, sector aligned
+    uint32_t length;        // Bytes stored
+    uint32_t checksum;      // FNV-1a of the bytes
+  };
+
+  // Manage `bytes` of flash starting `flashOffset` bytes into the chip,
+  // empty until extents are restored into it
+  void begin(uint32_t flashOffset, uint32_t bytes) {
+    base = flashOffset;
+    size = bytes & ~(REGION_SECTOR_BYTES - 1);
+    count = 0;
+    writing = -1;
+    moving = -1;
+    verifying = 0;
+    verified = 0;
+    verifyHash = REGION_HASH_SEED;
+  }
+
+  int sampleCount() const { return count; }
+  const Extent& extent(int index) const { return extents[index]; }
+
+  // False for the sample still being written, which has no checksum yet
+  bool complete(int index) const { return index != writing; }
+
+  // Take back an extent saved before a restart. Returns false if it is
+  // out of range or overlaps another; its bytes are checked later, by
+  // verifyStep().
+  bool restore(const Extent& saved) {
+    if (count >= MaxSamples || saved.offset % REGION_SECTOR_BYTES != 0 ||
+        saved.length == 0 || saved.offset >= size ||
+        roundToSectors(saved.length) > size - saved.offset) {
+      return false;
+    }
+
+    int at = 0;
+    while (at < count && extents[at].offset < saved.offset) at++;
+    if ((at > 0 && end(at - 1) > saved.offset) ||
+        (at < count &&
+         saved.offset + roundToSectors(saved.length) > extents[at].offset)) {
+      return false;
+    }
+
+    insert(at, saved);
+    verifying = 0;  // Nothing has been checked yet
+    return true;
+  }
+
+  // A stored sample's bytes, read through the XIP window without
+  // allocating in the cache so streaming doesn't evict code. A sample
+  // being moved is read from its old copy until the move completes.
+  // nullptr if the sample isn't stored or is still being written.
+  const uint8_t* find(const char* path, uint32_t& length) const {
+    int index = indexOf(path);
+    if (index < 0 || index == writing) return nullptr;
+    length = extents[index].length;
+    return data(extents[index].offset);
+  }
+
+  // Start storing `bytes` under `path` in the lowest gap that holds them,
+  // replacing any older copy. Remove and save an older copy first, so its
+  // sectors aren't rewritten while the saved directory still names them.
+  // A move under way is abandoned, as its target may be the gap chosen.
+  // Returns false if no gap is big enough.
+  bool create(const char* path, uint32_t bytes) {
+    if (writing >= 0) return false;
+    remove(path);
+    moving = -1;
+    if (count >= MaxSamples || bytes == 0) return false;
+
+    uint32_t needed = roundToSectors(bytes);
+    uint32_t at = 0;
+    int index = 0;
+    while (index < count && extents[index].offset - at < needed) {
+      at = end(index);
+      index++;
+    }
+    if (index == count && size - at < needed) return false;
+
+    Extent extent = {};
+    snprintf(extent.path, sizeof(extent.path), "%s", path);
+    extent.offset = at;
+    extent.length = bytes;
+    insert(index, extent);
+    writing = index;
+    written = 0;
+    pageFill = 0;
+    erased = 0;
+    writeHash = REGION_HASH_SEED;
+    return true;
+  }
+
+  // Append to the sample being stored
+  void write(const uint8_t* bytes, uint32_t length) {
+    if (writing < 0) return;
+
+    uint32_t limit = extents[writing].length;
+    while (length > 0 && written < limit) {
+      uint32_t chunk = min(min(length, REGION_PAGE_BYTES - pageFill),
+                           limit - written);
+      memcpy(page + pageFill, bytes, chunk);
+      writeHash = checksum(writeHash, page + pageFill, chunk);
+      pageFill += chunk;
+      written += chunk;
+      bytes += chunk;
+      length -= chunk;
+      if (pageFill == REGION_PAGE_BYTES) flushPage();
+    }
+  }
+
+  // True if `bytes` more can be appended, and the sample finished,
+  // without erasing a sector
+  bool erasedFor(uint32_t bytes) const {
+    if (writing < 0) return false;
+    return min(written + bytes, extents[writing].length) <= erased;
+  }
+
+  // Erase the next sector of the sample being stored ahead of its writes,
+  // so the erase can be done at a quiet moment. Returns false once the
+  // whole sample is erased.
+  bool eraseAhead() {
+    if (writing < 0 || erased >= extents[writing].length) return false;
+    erase(extents[writing].offset + erased);
+    erased += REGION_SECTOR_BYTES;
+    return true;
+  }
+
+  // Finish the sample being stored. A sample cut short is dropped.
+  bool finish() {
+    if (writing < 0) return false;
+    if (pageFill > 0) flushPage();
+
+    int index = writing;
+    writing = -1;
+    Extent& extent = extents[index];
+    if (written != extent.length) {
+      drop(index);
+      return false;
+    }
+
+    extent.checksum = writeHash;
+    return true;
+  }
+
+  // Give up on the sample being stored
+  void abort() {
+    if (writing < 0) return;
+    drop(writing);
+    writing = -1;
+  }
+
+  // Forget a stored sample, leaving a gap for compaction. Returns false if
+  // it wasn't stored.
+  bool remove(const char* path) {
+    int index = indexOf(path);
+    if (index < 0 || index == writing) return false;
+    if (index == moving) moving = -1;
+    drop(index);
+    return true;
+  }
+
+  // True while compaction has a sample to move
+  bool fragmented() const {
+    uint32_t to;
+    return moving >= 0 || nextMove(to) >= 0;
+  }
+
+  // Copy one sector of a sample down into a gap below it. The gap holds
+  // the whole sample, so the copy never touches the source, which stays
+  // in the directory until the last sector is copied and checked. Returns
+  // true when the directory has changed: the sample now names its new
+  // offset, or was dropped because its bytes didn't match.
+  bool compactStep() {
+    if (writing >= 0) return false;
+    if (moving < 0) {
+      moving = nextMove(moveTo);
+      if (moving < 0) return false;
+      moved = 0;
+      moveHash = REGION_HASH_SEED;
+    }
+
+    Extent& extent = extents[moving];
+    uint32_t copy = min(REGION_SECTOR_BYTES, extent.length - moved);
+    erase(moveTo + moved);
+    for (uint32_t done = 0; done < copy; done += REGION_PAGE_BYTES) {
+      memcpy(page, data(extent.offset + moved + done), REGION_PAGE_BYTES);
+      moveHash = checksum(moveHash, page,
+                          min(REGION_PAGE_BYTES, copy - done));
+      program(moveTo + moved + done, page);
+    }
+
+    moved += copy;
+    if (moved < extent.length) return false;
+
+    // The copy doubles as a check of the source; a moved sample is never
+    // left to verifyStep(), as it may now sit below the check's progress
+    int index = moving;
+    moving = -1;
+    if (moveHash != extent.checksum) {
+      dropDamaged(index);
+      return true;
+    }
+    Extent landed = extent;
+    landed.offset = moveTo;
+    drop(index);
+    int at = 0;
+    while (at < count && extents[at].offset < landed.offset) at++;
+    insert(at, landed);
+    return true;
+  }
+
+  // Check up to `bytes` more of the stored samples against their
+  // checksums, one sample after another, once after boot. Returns true
+  // when a sample has failed and been dropped, which changes the
+  // directory.
+  bool verifyStep(uint32_t bytes) {
+    while (verifying < count && verifying == writing) nextVerify();
+    if (verifying >= count) return false;
+
+    Extent& extent = extents[verifying];
+    uint8_t chunk[REGION_PAGE_BYTES] __attribute__((aligned(4)));
+    uint32_t limit = min(bytes, extent.length - verified);
+    for (uint32_t done = 0; done < limit; done += REGION_PAGE_BYTES) {
+      uint32_t length = min(REGION_PAGE_BYTES, limit - done);
+      // Whole words through the uncached window, then hashed from RAM
+      memcpy(chunk, data(extent.offset + verified + done),
+             (length + 3) & ~3u);
+      verifyHash = checksum(verifyHash, chunk, length);
+    }
+
+    verified += limit;
+    if (verified < extent.length) return false;
+
+    if (verifyHash != extent.checksum) {
+      dropDamaged(verifying);
+      return true;
+    }
+    nextVerify();
+    return false;
+  }
+
+  // Samples dropped because their bytes didn't match, and the last one's
+  // path
+  uint32_t damagedCount() const { return damagedSamples; }
+  const char* lastDamaged() const { return damaged; }
+
+  uint32_t capacity() const { return size; }
+
+  uint32_t freeBytes() const {
+    uint32_t used = 0;
+    for (int i = 0; i < count; i++) used += roundToSectors(extents[i].length);
+    return size - used;
+  }
+
+  uint32_t largestGap() const {
+    uint32_t largest = 0;
+    uint32_t at = 0;
+    for (int i = 0; i < count; i++) {
+      largest = max(largest, extents[i].offset - at);
+      at = end(i);
+    }
+    return max(largest, size - at);
+  }
+
+ private:
+  static uint32_t roundToSectors(uint32_t bytes) {
+    return (bytes + REGION_SECTOR_BYTES - 1) & ~(REGION_SECTOR_BYTES - 1);
+  }
+
+  // Region offset just past an extent's last sector
+  uint32_t end(int index) const {
+    return extents[index].offset + roundToSectors(extents[index].length);
+  }
+
+  const uint8_t* data(uint32_t offset) const {
+    return (const uint8_t*)(uintptr_t)(XIP_NOCACHE_NOALLOC_BASE + base +
+                                       offset);
+  }
+
+  int indexOf(const char* path) const {
+    for (int i = 0; i < count; i++) {
+      if (strcmp(extents[i].path, path) == 0) return i;
+    }
+    return -1;
+  }
+
+  // Pick the next move: working up from the lowest gap, the largest
+  // sample above it that fits in it whole. Every move goes down, so
+  // compaction always ends, but a gap too small for any sample above it
+  // stays until a neighbour is removed. Returns the extent, or -1.
+  int nextMove(uint32_t& to) const {
+    uint32_t at = 0;
+    for (int gap = 0; gap < count; gap++) {
+      uint32_t space = extents[gap].offset - at;
+      int best = -1;
+      for (int i = gap; space > 0 && i < count; i++) {
+        uint32_t needed = roundToSectors(extents[i].length);
+        if (needed <= space &&
+            (best < 0 || needed >= roundToSectors(extents[best].length))) {
+          best = i;
+        }
+      }
+      if (best >= 0) {
+        to = at;
+        return best;
+      }
+      at = end(gap);
+    }
+    return -1;
+  }
+
+  void dropDamaged(int index) {
+    snprintf(damaged, sizeof(damaged), "%s", extents[index].path);
+    damagedSamples++;
+    drop(index);
+  }
+
+  void nextVerify() {
+    verifying++;
+    verified = 0;
+    verifyHash = REGION_HASH_SEED;
+  }
+
+  // Extents stay sorted by offset
+  void insert(int index, const Extent& extent) {
+    memmove(&extents[index + 1], &extents[index],
+            (count - index) * sizeof(Extent));
+    count++;
+    if (writing >= index) writing++;
+    if (moving >= index) moving++;
+    if (verifying >= index) verifying++;
+    extents[index] = extent;
+  }
+
+  void drop(int index) {
+    memmove(&extents[index], &extents[index + 1],
+            (count - index - 1) * sizeof(Extent));
+    count--;
+    if (writing > index) writing--;
+    if (moving > index) moving--;
+    if (verifying > index) {
+      verifying--;
+    } else if (verifying == index) {
+      // The next sample slides into its place: start that one afresh
+      verified = 0;
+      verifyHash = REGION_HASH_SEED;
+    }
+  }
+
+  // Program the buffered page, erasing each sector as writing enters it
+  // unless eraseAhead() already has
+  void flushPage() {
+    uint32_t start = written - pageFill;
+    if (start >= erased) {
+      erase(extents[writing].offset + start);
+      erased += REGION_SECTOR_BYTES;
+    }
+    uint32_t at = extents[writing].offset + start;
+    memset(page + pageFill, 0xFF, REGION_PAGE_BYTES - pageFill);
+    program(at, page);
+    pageFill = 0;
+  }
+
+  void erase(uint32_t offset) {
+    noInterrupts();
+    rp2040.idleOtherCore();
+    flash_range_erase(base + offset, REGION_SECTOR_BYTES);
+    rp2040.resumeOtherCore();
+    interrupts();
+  }
+
+  void program(uint32_t offset, const uint8_t* bytes) {
+    noInterrupts();
+    rp2040.idleOtherCore();
+    flash_range_program(base + offset, bytes, REGION_PAGE_BYTES);
+    rp2040.resumeOtherCore();
+    interrupts();
+  }
+
+  // FNV-1a, continued from `hash`
+  static uint32_t checksum(uint32_t hash, const uint8_t* bytes,
+                           uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+      hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+  }
+
+  Extent extents[MaxSamples];
+  int count = 0;
+  uint32_t base = 0;  // Flash offset of the region
+  uint32_t size = 0;
+
+  int writing = -1;      // Extent being stored, -1 for none
+  uint32_t written = 0;  // Bytes of it taken so far
+  uint32_t erased = 0;   // Bytes of it erased, in whole sectors
+  uint32_t pageFill = 0;
+  uint32_t writeHash = REGION_HASH_SEED;  // Of the bytes taken
+
+  int moving = -1;       // Extent being compacted, -1 for none
+  uint32_t moveTo = 0;   // Its new offset
+  uint32_t moved = 0;    // Bytes of it copied so far
+  uint32_t moveHash = 0;  // Of the bytes copied
+
+  int verifying = 0;        // Extent being checked; count once all are
+  uint32_t verified = 0;    // Bytes of it hashed so far
+  uint32_t verifyHash = REGION_HASH_SEED;
+  uint32_t damagedSamples = 0;
+  char damaged[PathLength] = "";
+
+  uint8_t page[REGION_PAGE_BYTES] __attribute__((aligned(4)));
+};
+
+#endif  // SAMPLE_REGION_H
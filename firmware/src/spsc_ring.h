@@ -0,0 +1,119 @@
+/**
+ * SPSC Ring
+ * Single-producer, single-consumer queue over a power-of-two array. The
+ * read and write positions run freely and are masked on access, so a
+ * full ring needs no spare slot and wrapping never divides. Bulk users
+ * get the filled or free region as at most two contiguous spans, to mix
+ * straight out of the ring or read flash straight into it.
+ *
+ * One side may run in an interrupt: each side writes only its own
+ * position, and publishes it after the items it covers.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <Arduino.h>
+
+// A contiguous run of ring slots
+template <typename T>
+struct RingSpan {
+  T* data;
+  uint32_t count;
+};
+
+template <typename T, uint32_t Capacity>
+class SpscRing {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "Ring capacity must be a power of two");
+
+ public:
+  static const uint32_t capacity = Capacity;
+  static const uint32_t mask = Capacity - 1;
+
+  SpscRing() = default;
+  explicit SpscRing(T* storage) : items(storage) {}
+
+  // Point the ring at an array of Capacity items, or nullptr, and empty
+  // it. Neither side may be using the ring.
+  void attach(T* storage) {
+    items = storage;
+    readPos = 0;
+    writePos = 0;
+  }
+
+  T* storage() const { return items; }
+  uint32_t size() const { return writePos - readPos; }
+  uint32_t space() const { return Capacity - size(); }
+  bool empty() const { return writePos == readPos; }
+
+  // Producer: queue one item. Returns false if the ring is full.
+  bool push(const T& item) {
+    uint32_t at = writePos;
+    if (at - readPos == Capacity) return false;
+    __sync_synchronize();
+    items[at & mask] = item;
+    __sync_synchronize();
+    writePos = at + 1;
+    return true;
+  }
+
+  // Consumer: take the oldest item. Returns false if the ring is empty.
+  bool pop(T& item) {
+    uint32_t at = readPos;
+    if (writePos == at) return false;
+    __sync_synchronize();
+    item = items[at & mask];
+    __sync_synchronize();
+    readPos = at + 1;
+    return true;
+  }
+
+  // Producer: up to `limit` free slots as one or two spans, in order.
+  // Returns the number of spans; fill them, then commitWrite().
+  int writeSpans(RingSpan<T> spans[2], uint32_t limit = Capacity) const {
+    uint32_t count = min(space(), limit);
+    __sync_synchronize();
+    return split(writePos, count, spans);
+  }
+
+  // Producer: publish `count` items written through writeSpans()
+  void commitWrite(uint32_t count) {
+    __sync_synchronize();
+    writePos = writePos + count;
+  }
+
+  // Consumer: up to `limit` queued items as one or two spans, oldest
+  // first. Returns the number of spans; read them, then commitRead().
+  int readSpans(RingSpan<const T> spans[2], uint32_t limit = Capacity) const {
+    uint32_t count = min(size(), limit);
+    __sync_synchronize();
+    return split(readPos, count, spans);
+  }
+
+  // Consumer: free `count` items read through readSpans()
+  void commitRead(uint32_t count) {
+    __sync_synchronize();
+    readPos = readPos + count;
+  }
+
+ private:
+  template <typename U>
+  int split(uint32_t position, uint32_t count, RingSpan<U> spans[2]) const {
+    if (count == 0) return 0;
+
+    uint32_t start = position & mask;
+    uint32_t first = min(count, Capacity - start);
+    spans[0] = {items + start, first};
+    if (first == count) return 1;
+
+    spans[1] = {items, count - first};
+    return 2;
+  }
+
+  T* items = nullptr;
+  volatile uint32_t readPos = 0;   // Written only by the consumer
+  volatile uint32_t writePos = 0;  // Written only by the producer
+};
+
+#endif  // SPSC_RING_H
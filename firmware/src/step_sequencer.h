@@ -0,0 +1,176 @@
+/**
+ * Step Sequencer
+ * Four-track, 16-step pattern sequencer timed in audio frames rather than
+ * milliseconds. The audio loop asks for the steps that fall inside each
+ * block it is about to render and starts them at their exact frame. The
+ * step grid free-runs at the pattern tempo unless retime() locks it to an
+ * external clock. A step can be ratcheted into 2-8 evenly spaced hits.
+ */
+
+#ifndef STEP_SEQUENCER_H
+#define STEP_SEQUENCER_H
+
+#include <Arduino.h>
+
+#define SEQUENCER_TRACKS 4
+#define SEQUENCER_STEPS 16
+#define SEQUENCER_STEPS_PER_BEAT 4  // 16th notes
+#define SEQUENCER_MIN_BPM 40
+#define SEQUENCER_MAX_BPM 300
+#define SEQUENCER_MAX_SWING 50  // Percent of a step the off-beats can lag
+#define SEQUENCER_MAX_RATCHET 8  // Most hits a step can be split into
+#define SEQUENCER_MAX_DECAY 90   // Percent a ratchet repeat can drop by
+
+// A whole pattern in 54 bytes: one bit per step per track, plus a nibble
+// per step for its ratchet
+struct SequencerPattern {
+  uint16_t steps[SEQUENCER_TRACKS];    // Bit n set: track plays step n
+  uint16_t accents[SEQUENCER_TRACKS];  // Bit n set: that hit is accented
+  uint16_t bpm;
+  uint8_t length;  // Steps before the pattern wraps (1-16)
+  uint8_t swing;   // Percent of a step that odd steps are delayed by
+  uint8_t ratchets[SEQUENCER_TRACKS][SEQUENCER_STEPS / 2];  // Hits - 1
+  uint8_t ratchetDecay;  // Percent each ratchet repeat is quieter by
+};
+
+// Tracks starting at one step
+struct SequencerStep {
+  uint64_t frame;
+  uint8_t tracks;   // Bit per track that plays
+  uint8_t accents;  // Bit per track whose hit is accented
+  uint8_t ratchets[SEQUENCER_TRACKS];  // Hits each track plays in the step
+};
+
+class StepSequencer {
+ public:
+  explicit StepSequencer(uint32_t sampleRate) : sampleRate(sampleRate) {
+    memset(&pattern, 0, sizeof(pattern));
+    pattern.length = SEQUENCER_STEPS;
+    setTempo(120);
+  }
+
+  void setTempo(uint16_t bpm) {
+    pattern.bpm = constrain(bpm, SEQUENCER_MIN_BPM, SEQUENCER_MAX_BPM);
+    framesPerStepQ16 = ((uint64_t)sampleRate * 60 << 16) /
+                       (pattern.bpm * SEQUENCER_STEPS_PER_BEAT);
+  }
+  uint16_t tempo() const { return pattern.bpm; }
+
+  // Replace the pattern, keeping its values in range
+  void load(const SequencerPattern& saved) {
+    pattern = saved;
+    if (pattern.length < 1 || pattern.length > SEQUENCER_STEPS) {
+      pattern.length = SEQUENCER_STEPS;
+    }
+    pattern.swing = min(pattern.swing, (uint8_t)SEQUENCER_MAX_SWING);
+    pattern.ratchetDecay =
+        min(pattern.ratchetDecay, (uint8_t)SEQUENCER_MAX_DECAY);
+    setTempo(pattern.bpm);
+  }
+  const SequencerPattern& current() const { return pattern; }
+
+  void setSwing(int percent) {
+    pattern.swing = constrain(percent, 0, SEQUENCER_MAX_SWING);
+  }
+
+  void setRatchetDecay(int percent) {
+    pattern.ratchetDecay = constrain(percent, 0, SEQUENCER_MAX_DECAY);
+  }
+
+  // Play from step 0, with the first step at the given frame
+  void start(uint64_t frame) {
+    nextStepQ16 = frame << 16;
+    step = 0;
+    stepCount = 0;
+    isRunning = true;
+  }
+  void stop() { isRunning = false; }
+  bool running() const { return isRunning; }
+
+  // Step that will play next (or played last, once stopped)
+  int position() const { return step; }
+
+  // Steps taken since start(), counting the pattern's repeats
+  uint32_t stepsTaken() const { return stepCount; }
+
+  // Frames per step at the current tempo or clock, Q16
+  uint64_t stepLength() const { return framesPerStepQ16; }
+
+  // Lock the grid to an external clock: step baseStep (a stepsTaken()
+  // count) falls on baseFrameQ16, with framesPerStep Q16 frames between
+  // steps. Steps already taken are never repeated or skipped; the next
+  // one simply moves onto the new grid.
+  void retime(uint64_t baseFrameQ16, uint32_t baseStep,
+              uint64_t framesPerStep) {
+    framesPerStepQ16 = framesPerStep;
+    int32_t ahead = (int32_t)(stepCount - baseStep);
+    nextStepQ16 = baseFrameQ16 + (int64_t)ahead * (int64_t)framesPerStep;
+  }
+
+  // Take the next step starting before endFrame, if any. Steps that were
+  // due earlier still come out (at their own frame), so a late caller
+  // catches up instead of dropping them.
+  bool nextStep(uint64_t endFrame, SequencerStep& out) {
+    if (!isRunning) return false;
+
+    // Swing pushes the odd (off-beat) steps later
+    uint64_t stepQ16 = nextStepQ16;
+    if (step & 1) {
+      stepQ16 += framesPerStepQ16 * pattern.swing / 100;
+    }
+    if (stepQ16 >= endFrame << 16) return false;
+
+    out.frame = stepQ16 >> 16;
+    out.tracks = 0;
+    out.accents = 0;
+    for (int track = 0; track < SEQUENCER_TRACKS; track++) {
+      if (pattern.steps[track] & (1u << step)) out.tracks |= 1u << track;
+      if (pattern.accents[track] & (1u << step)) out.accents |= 1u << track;
+      out.ratchets[track] = ratchet(track, step);
+    }
+
+    // Fractional frames accumulate in Q16, so the tempo doesn't drift
+    nextStepQ16 += framesPerStepQ16;
+    step = (step + 1) % pattern.length;
+    stepCount++;
+    return true;
+  }
+
+  // Cycle a step through off, on and accented
+  void toggleStep(int track, int index) {
+    uint16_t bit = 1u << index;
+    if (!(pattern.steps[track] & bit)) {
+      pattern.steps[track] |= bit;
+    } else if (!(pattern.accents[track] & bit)) {
+      pattern.accents[track] |= bit;
+    } else {
+      pattern.steps[track] &= ~bit;
+      pattern.accents[track] &= ~bit;
+    }
+  }
+
+  // Hits played across a step: 1, or 2-8 for a ratchet
+  int ratchet(int track, int index) const {
+    int shift = (index & 1) * 4;
+    return ((pattern.ratchets[track][index / 2] >> shift) & 0x7) + 1;
+  }
+
+  // Cycle a step's ratchet from a single hit up to SEQUENCER_MAX_RATCHET
+  void cycleRatchet(int track, int index) {
+    int shift = (index & 1) * 4;
+    int hits = ratchet(track, index) % SEQUENCER_MAX_RATCHET + 1;
+    uint8_t& packed = pattern.ratchets[track][index / 2];
+    packed = (packed & ~(0xF << shift)) | (hits - 1) << shift;
+  }
+
+ private:
+  SequencerPattern pattern;
+  uint32_t sampleRate;
+  uint64_t framesPerStepQ16 = 0;  // Frames per step, Q16
+  uint64_t nextStepQ16 = 0;       // Frame of the next step, Q16
+  uint32_t stepCount = 0;         // Steps taken since start()
+  int step = 0;
+  bool isRunning = false;
+};
+
+#endif  // STEP_SEQUENCER_H
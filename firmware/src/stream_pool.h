@@ -0,0 +1,66 @@
+/**
+ * Stream Buffer Pool
+ * Fixed-size blocks carved from a static arena, leased to voices while
+ * they play and returned when they stop
+ */
+
+#ifndef STREAM_POOL_H
+#define STREAM_POOL_H
+
+#include <Arduino.h>
+
+template <uint32_t BlockSamples, uint32_t BlockCount>
+class StreamBufferPool {
+  static_assert(BlockCount > 0 && BlockCount <= 32,
+                "Free list is a 32-bit mask");
+
+ public:
+  static const uint32_t blockSamples = BlockSamples;
+  static const uint32_t blockCount = BlockCount;
+
+  // Lease a block, or nullptr when every block is in use
+  int16_t* acquire() {
+    if (freeMask == 0) {
+      failedLeases++;
+      return nullptr;
+    }
+
+    uint32_t index = __builtin_ctz(freeMask);
+    freeMask &= ~(1u << index);
+
+    inUse++;
+    if (inUse > highWatermark) {
+      highWatermark = inUse;
+    }
+    totalLeases++;
+
+    return arena[index];
+  }
+
+  // Return a block previously handed out by acquire()
+  void release(int16_t* block) {
+    if (!block) return;
+
+    uint32_t index = (block - arena[0]) / BlockSamples;
+    if (index >= BlockCount || (freeMask & (1u << index))) return;
+
+    freeMask |= 1u << index;
+    inUse--;
+  }
+
+  uint32_t blocksInUse() const { return inUse; }
+  uint32_t peakBlocksInUse() const { return highWatermark; }
+  uint32_t leaseCount() const { return totalLeases; }
+  uint32_t failedLeaseCount() const { return failedLeases; }
+  static constexpr uint32_t arenaBytes() { return sizeof(arena); }
+
+ private:
+  int16_t arena[BlockCount][BlockSamples] __attribute__((aligned(4)));
+  uint32_t freeMask = (uint32_t)((1ull << BlockCount) - 1);
+  uint32_t inUse = 0;
+  uint32_t highWatermark = 0;
+  uint32_t totalLeases = 0;
+  uint32_t failedLeases = 0;
+};
+
+#endif  // STREAM_POOL_H
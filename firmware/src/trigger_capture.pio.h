@@ -0,0 +1,90 @@
+// -------------------------------------------------- //
+// This file is autogenerated by pioasm; do not edit! //
+// -------------------------------------------------- //
+
+#pragma once
+
+#if !PICO_NO_HARDWARE
+#include "hardware/pio.h"
+#endif
+
+// --------------- //
+// trigger_capture //
+// --------------- //
+
+#define trigger_capture_wrap_target 0
+#define trigger_capture_wrap 13
+
+static const uint16_t trigger_capture_program_instructions[] = {
+            //     .wrap_target
+    0xa0c3, //  0: mov    isr, null
+    0x4004, //  1: in     pins, 4
+    0xa046, //  2: mov    y, isr
+    0xa0c1, //  3: mov    isr, x
+    0xa027, //  4: mov    x, osr
+    0x00a9, //  5: jmp    x!=y, 9
+    0xa026, //  6: mov    x, isr
+    0x0340, //  7: jmp    x--, 0 [3]
+    0x0000, //  8: jmp    0
+    0xa0e2, //  9: mov    osr, y
+    0xa026, // 10: mov    x, isr
+    0x4044, // 11: in     y, 4
+    0x8000, // 12: push   noblock
+    0x0040, // 13: jmp    x--, 0
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program trigger_capture_program = {
+    .instructions = trigger_capture_program_instructions,
+    .length = 14,
+    .origin = -1,
+};
+
+static inline pio_sm_config trigger_capture_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + trigger_capture_wrap_target, offset + trigger_capture_wrap);
+    return c;
+}
+
+#include "hardware/clocks.h"
+
+// Cycles per pass through the sampling loop
+#define TRIGGER_CAPTURE_CYCLES_PER_SAMPLE 11
+
+// Start sampling at close to sample_rate_hz. The divider only has 8
+// fractional bits, so the rate is rarely exact: returns the divider
+// actually programmed, in 1/256ths, for converting counts to time.
+static inline uint32_t trigger_capture_program_init(PIO pio, uint sm,
+                                                    uint offset,
+                                                    uint first_pin,
+                                                    uint32_t sample_rate_hz) {
+    pio_sm_config c = trigger_capture_program_get_default_config(offset);
+
+    // Pins stay plain GPIO inputs with their pull-ups; PIO only reads them
+    sm_config_set_in_pins(&c, first_pin);
+
+    // Shift left so "in y, 4" appends the pins below the counter
+    sm_config_set_in_shift(&c, false, false, 32);
+    sm_config_set_out_shift(&c, true, false, 32);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
+
+    uint64_t cycles_per_second =
+        (uint64_t)sample_rate_hz * TRIGGER_CAPTURE_CYCLES_PER_SAMPLE;
+    uint32_t div256 = (uint32_t)(((uint64_t)clock_get_hz(clk_sys) * 256 +
+                                  cycles_per_second / 2) /
+                                 cycles_per_second);
+    sm_config_set_clkdiv_int_frac(&c, div256 >> 8, div256 & 0xFF);
+
+    pio_sm_init(pio, sm, offset, &c);
+
+    // Seed the previous snapshot with all inputs idle (high) so nothing
+    // is pushed until a pin actually moves, and start the counter at 0
+    pio_sm_exec(pio, sm, pio_encode_set(pio_x, 0xF));
+    pio_sm_exec(pio, sm, pio_encode_mov(pio_osr, pio_x));
+    pio_sm_exec(pio, sm, pio_encode_set(pio_x, 0));
+    pio_sm_set_enabled(pio, sm, true);
+    return div256;
+}
+#endif
+
@@ -0,0 +1,62 @@
+/**
+ * Waveform Overview
+ * Min/max peaks of a whole sample squeezed into one column per display
+ * pixel. Built once while the sample is copied to flash and stored in an
+ * extra RIFF chunk after its audio, so drawing it never touches the audio
+ * data again.
+ */
+
+#ifndef WAVEFORM_OVERVIEW_H
+#define WAVEFORM_OVERVIEW_H
+
+#include <Arduino.h>
+
+#define OVERVIEW_COLUMNS 128     // One column per OLED pixel
+#define OVERVIEW_CHUNK_ID "ovw "  // RIFF chunk holding a WaveformOverview
+
+// Peaks are the top 8 bits of each 16-bit sample
+struct WaveformOverview {
+  int8_t low[OVERVIEW_COLUMNS];   // Most negative level in each column
+  int8_t high[OVERVIEW_COLUMNS];  // Most positive level in each column
+};
+
+class OverviewBuilder {
+ public:
+  // Start an overview of totalSamples samples, spread evenly across the
+  // columns. Columns no sample falls in stay flat.
+  void begin(WaveformOverview& target, uint32_t totalSamples) {
+    overview = &target;
+    memset(&target, 0, sizeof(target));
+    total = max(totalSamples, (uint32_t)1);
+    position = 0;
+    column = 0;
+    columnEnd = boundary(1);
+  }
+
+  // Fold in the next sample
+  void add(int16_t sample) {
+    while (position >= columnEnd && column < OVERVIEW_COLUMNS - 1) {
+      column++;
+      columnEnd = boundary(column + 1);
+    }
+
+    int8_t level = sample >> 8;
+    if (level < overview->low[column]) overview->low[column] = level;
+    if (level > overview->high[column]) overview->high[column] = level;
+    position++;
+  }
+
+ private:
+  // First sample past the given column
+  uint32_t boundary(uint32_t columnIndex) const {
+    return (uint64_t)columnIndex * total / OVERVIEW_COLUMNS;
+  }
+
+  WaveformOverview* overview = nullptr;
+  uint32_t total = 1;
+  uint32_t position = 0;
+  uint32_t column = 0;
+  uint32_t columnEnd = 0;
+};
+
+#endif  // WAVEFORM_OVERVIEW_H
@@ -0,0 +1,31 @@
+/**
+ * Host Arduino Shim
+ * Just enough of Arduino.h for the firmware's portable headers to build
+ * with the host compiler, so they can be tested off the board.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+using std::max;
+using std::min;
+
+#define constrain(amt, low, high) \
+  ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+// One core and no interrupts to hold off
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+struct HostRp2040 {
+  void idleOtherCore() {}
+  void resumeOtherCore() {}
+};
+inline HostRp2040 rp2040;
+
+#endif  // HOST_ARDUINO_H
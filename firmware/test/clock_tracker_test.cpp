@@ -0,0 +1,104 @@
+/**
+ * Clock Tracker Test
+ * Feeds ClockTracker a steady clock with Gaussian timing jitter, then a
+ * slow tempo ramp, and compares how far its predicted pulse positions sit
+ * from the true ones against how far the raw edges do. Prints the error
+ * at each jitter level and fails if tracking stops smoothing the input or
+ * loses the lock.
+ */
+
+#include <cmath>
+#include <random>
+
+#include "clock_tracker.h"
+#include "step_sequencer.h"
+
+#define SIM_SAMPLE_RATE 48000
+#define SIM_PERIOD_FRAMES 6000.0   // 16ths at 120 BPM
+#define SIM_PULSES 4000
+#define SIM_SETTLE_PULSES 50       // Ignored while the lock settles
+#define SIM_RAMP_START 2000        // Pulses 2000-2499 speed up...
+#define SIM_RAMP_END 2500          // ...by 0.05% of a period each
+#define SIM_RAMP_SETTLE_END 2600   // Ramp error is reported separately
+
+// Same period limits as the firmware, for a clock pulse per step
+#define SIM_MIN_PERIOD \
+  (SIM_SAMPLE_RATE * 60 / (SEQUENCER_MAX_BPM * SEQUENCER_STEPS_PER_BEAT))
+#define SIM_MAX_PERIOD \
+  (SIM_SAMPLE_RATE * 60 / (SEQUENCER_MIN_BPM * SEQUENCER_STEPS_PER_BEAT))
+
+struct ErrorStats {
+  double sumSquares = 0;
+  double largest = 0;
+  int count = 0;
+
+  void add(double error) {
+    sumSquares += error * error;
+    largest = std::max(largest, std::fabs(error));
+    count++;
+  }
+  double rms() const { return count ? std::sqrt(sumSquares / count) : 0; }
+};
+
+int main() {
+  std::mt19937 random(1);
+  int failures = 0;
+
+  printf("jitter   input rms  tracked rms (max)  ramp rms (max)  locks\n");
+  for (double jitterMs : {0.0, 0.25, 1.0, 2.0}) {
+    ClockTracker tracker(SIM_MIN_PERIOD, SIM_MAX_PERIOD);
+    std::normal_distribution<double> jitter(
+        0, jitterMs * SIM_SAMPLE_RATE / 1000);
+
+    ErrorStats input;
+    ErrorStats tracked;
+    ErrorStats ramp;
+    double period = SIM_PERIOD_FRAMES;
+    double truth = 1000;
+    int unlockedPulses = 0;
+
+    for (int pulse = 0; pulse < SIM_PULSES; pulse++) {
+      if (pulse > SIM_RAMP_START && pulse < SIM_RAMP_END) period *= 1.0005;
+      truth += period;
+      double edge = std::max(0.0, truth + jitter(random));
+      tracker.edge((uint64_t)std::llround(edge));
+
+      if (pulse < SIM_SETTLE_PULSES) continue;
+      if (!tracker.locked()) {
+        unlockedPulses++;
+        continue;
+      }
+
+      double error = tracker.phase() / 65536.0 - truth;
+      if (pulse >= SIM_RAMP_START && pulse < SIM_RAMP_SETTLE_END) {
+        ramp.add(error);
+      } else {
+        tracked.add(error);
+        input.add(edge - truth);
+      }
+    }
+
+    printf("%.2fms  %6.1f     %6.1f (%6.1f)     %6.1f (%6.1f)   %u\n",
+           jitterMs, input.rms(), tracked.rms(), tracked.largest, ramp.rms(),
+           ramp.largest, tracker.lockCount());
+
+    // Errors are in frames. Tracking must at least halve the jitter, and
+    // the lock must hold through the ramp.
+    if (tracker.lockCount() != 1 || unlockedPulses > 0) {
+      printf("  lock lost: %u locks, %d unlocked pulses\n",
+             tracker.lockCount(), unlockedPulses);
+      failures++;
+    }
+    if (tracked.rms() > std::max(1.0, input.rms() / 2)) {
+      printf("  tracked error not below half the input jitter\n");
+      failures++;
+    }
+  }
+
+  if (failures > 0) {
+    printf("clock_tracker_test: %d failures\n", failures);
+    return 1;
+  }
+  printf("clock_tracker_test: ok\n");
+  return 0;
+}
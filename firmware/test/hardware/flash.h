@@ -0,0 +1,51 @@
+/**
+ * Host Flash Shim
+ * The pico-sdk flash calls over a RAM array, so code that erases and
+ * programs flash can be tested off the board. Enforces the hardware's
+ * rules: whole aligned sectors and pages, and programming only clears
+ * bits. A test can watch every erase and program through hostFlashTouched.
+ */
+
+#ifndef HOST_HARDWARE_FLASH_H
+#define HOST_HARDWARE_FLASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+#define HOST_FLASH_BYTES (256u * 1024)
+
+inline uint8_t hostFlash[HOST_FLASH_BYTES];
+inline uint32_t hostFlashErases = 0;
+inline uint32_t hostFlashErrors = 0;  // Calls that broke the rules
+inline void (*hostFlashTouched)(uint32_t offset, size_t count) = nullptr;
+
+inline void flash_range_erase(uint32_t offset, size_t count) {
+  if (offset % FLASH_SECTOR_SIZE != 0 || count % FLASH_SECTOR_SIZE != 0 ||
+      offset + count > HOST_FLASH_BYTES) {
+    hostFlashErrors++;
+    return;
+  }
+  if (hostFlashTouched) hostFlashTouched(offset, count);
+  memset(hostFlash + offset, 0xFF, count);
+  hostFlashErases++;
+}
+
+inline void flash_range_program(uint32_t offset, const uint8_t* data,
+                                size_t count) {
+  if (offset % FLASH_PAGE_SIZE != 0 || count % FLASH_PAGE_SIZE != 0 ||
+      offset + count > HOST_FLASH_BYTES) {
+    hostFlashErrors++;
+    return;
+  }
+  if (hostFlashTouched) hostFlashTouched(offset, count);
+  for (size_t i = 0; i < count; i++) {
+    // Bits that are already clear stay clear, as on the chip
+    if ((hostFlash[offset + i] & data[i]) != data[i]) hostFlashErrors++;
+    hostFlash[offset + i] &= data[i];
+  }
+}
+
+#endif  // HOST_HARDWARE_FLASH_H
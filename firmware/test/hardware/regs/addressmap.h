@@ -0,0 +1,13 @@
+/**
+ * Host Address Map Shim
+ * The uncached XIP window reads the host flash array directly.
+ */
+
+#ifndef HOST_HARDWARE_REGS_ADDRESSMAP_H
+#define HOST_HARDWARE_REGS_ADDRESSMAP_H
+
+#include <hardware/flash.h>
+
+#define XIP_NOCACHE_NOALLOC_BASE ((uintptr_t)hostFlash)
+
+#endif  // HOST_HARDWARE_REGS_ADDRESSMAP_H
@@ -0,0 +1,280 @@
+/**
+ * Sample Region Tests
+ * Runs SampleRegion over the host flash shim: first-fit placement,
+ * compaction that closes whole gaps without touching a sector the saved
+ * directory names, restoring after a move cut off part way, and the
+ * background check catching a damaged sample.
+ */
+
+#include "sample_region.h"
+
+#define TEST_REGION_SECTORS 16
+#define TEST_MAX_SAMPLES 8
+#define TEST_PATH_LENGTH 16
+
+using Region = SampleRegion<TEST_MAX_SAMPLES, TEST_PATH_LENGTH>;
+
+static int failures = 0;
+
+#define CHECK(condition)                                     \
+  do {                                                       \
+    if (!(condition)) {                                      \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+             #condition);                                    \
+      failures++;                                            \
+    }                                                        \
+  } while (0)
+
+// The directory as last saved, as the firmware keeps it on LittleFS
+static Region::Extent saved[TEST_MAX_SAMPLES];
+static int savedCount = 0;
+static int savedTouches = 0;  // Erases and programs of saved sectors
+
+static void save(const Region& region) {
+  savedCount = 0;
+  for (int i = 0; i < region.sampleCount(); i++) {
+    if (region.complete(i)) saved[savedCount++] = region.extent(i);
+  }
+}
+
+// What a power cut would lose: a write into a sector the saved
+// directory still names
+static void watchSaved(uint32_t offset, size_t count) {
+  for (int i = 0; i < savedCount; i++) {
+    uint32_t start = saved[i].offset;
+    uint32_t end = start + (saved[i].length + REGION_SECTOR_BYTES - 1) /
+                               REGION_SECTOR_BYTES * REGION_SECTOR_BYTES;
+    if (offset < end && offset + count > start) savedTouches++;
+  }
+}
+
+static uint8_t patternByte(char name, uint32_t i) {
+  return (uint8_t)(name * 37 + i * 7 + (i >> 8));
+}
+
+// Store `bytes` of a pattern keyed on `name`, written in uneven pieces
+static bool store(Region& region, char name, uint32_t bytes) {
+  char path[TEST_PATH_LENGTH];
+  snprintf(path, sizeof(path), "/%c", name);
+  if (!region.create(path, bytes)) return false;
+
+  uint8_t piece[300];
+  for (uint32_t at = 0; at < bytes;) {
+    uint32_t length = min(bytes - at, (uint32_t)(at % 3 == 0 ? 300 : 97));
+    for (uint32_t i = 0; i < length; i++) piece[i] = patternByte(name, at + i);
+    region.write(piece, length);
+    at += length;
+  }
+  bool stored = region.finish();
+  save(region);
+  return stored;
+}
+
+// Offset the sample is read from, or -1 if it can't be found or its
+// bytes are wrong
+static int64_t locate(const Region& region, char name, uint32_t bytes) {
+  char path[TEST_PATH_LENGTH];
+  snprintf(path, sizeof(path), "/%c", name);
+  uint32_t length = 0;
+  const uint8_t* data = region.find(path, length);
+  if (!data || length != bytes) return -1;
+  for (uint32_t i = 0; i < bytes; i++) {
+    if (data[i] != patternByte(name, i)) return -1;
+  }
+  return (int64_t)(data - hostFlash);
+}
+
+static bool removeSample(Region& region, char name) {
+  char path[TEST_PATH_LENGTH];
+  snprintf(path, sizeof(path), "/%c", name);
+  bool removed = region.remove(path);
+  save(region);
+  return removed;
+}
+
+static void resetFlash(Region& region) {
+  memset(hostFlash, 0xFF, sizeof(hostFlash));
+  savedCount = 0;
+  region.begin(0, TEST_REGION_SECTORS * REGION_SECTOR_BYTES);
+}
+
+// Reboot: a fresh region takes back the saved directory
+static void restart(Region& region) {
+  region.begin(0, TEST_REGION_SECTORS * REGION_SECTOR_BYTES);
+  for (int i = 0; i < savedCount; i++) CHECK(region.restore(saved[i]));
+}
+
+static void compactFully(Region& region) {
+  for (int step = 0; region.fragmented() && step < 1000; step++) {
+    if (region.compactStep()) save(region);
+  }
+  CHECK(!region.fragmented());
+}
+
+// New samples take the lowest gap that holds them whole
+static void testFirstFit() {
+  static Region region;
+  const uint32_t sector = REGION_SECTOR_BYTES;
+  resetFlash(region);
+
+  CHECK(store(region, 'a', 2 * sector));
+  CHECK(store(region, 'b', sector - 100));
+  CHECK(store(region, 'c', 3 * sector));
+  CHECK(locate(region, 'b', sector - 100) == 2 * sector);
+  CHECK(locate(region, 'c', 3 * sector) == 3 * sector);
+
+  // Too big for the one-sector gap b leaves, so it goes past c; a
+  // one-sector sample then fills the gap
+  CHECK(removeSample(region, 'b'));
+  CHECK(store(region, 'd', sector + 1));
+  CHECK(locate(region, 'd', sector + 1) == 6 * sector);
+  CHECK(store(region, 'e', 300));
+  CHECK(locate(region, 'e', 300) == 2 * sector);
+
+  // Replacing a sample frees its old run first
+  CHECK(removeSample(region, 'a'));
+  CHECK(store(region, 'f', 10));
+  CHECK(locate(region, 'f', 10) == 0);
+
+  // Enough free in total, but no single gap big enough
+  CHECK(region.freeBytes() == 9 * sector);
+  CHECK(region.largestGap() == 8 * sector);
+  CHECK(!store(region, 'g', 9 * sector));
+  CHECK(region.sampleCount() == 4);
+  CHECK(hostFlashErrors == 0);
+  CHECK(savedTouches == 0);
+}
+
+// Moves close the gaps up a sector at a time, the source still playing
+// and untouched until its copy is complete
+static void testCompaction() {
+  static Region region;
+  const uint32_t sector = REGION_SECTOR_BYTES;
+  resetFlash(region);
+
+  // a, a two-sector gap, b, a one-sector gap, c
+  CHECK(store(region, 'a', sector));
+  CHECK(store(region, 'x', 2 * sector));
+  CHECK(store(region, 'b', 2 * sector - 5));
+  CHECK(store(region, 'y', sector));
+  CHECK(store(region, 'c', sector / 2));
+  CHECK(removeSample(region, 'x'));
+  CHECK(removeSample(region, 'y'));
+  CHECK(region.fragmented());
+  CHECK(region.largestGap() < region.freeBytes());
+
+  // b fills the lower gap whole; halfway through it still reads from
+  // its old copy
+  CHECK(!region.compactStep());
+  CHECK(locate(region, 'b', 2 * sector - 5) == 3 * sector);
+  CHECK(region.compactStep());
+  save(region);
+  CHECK(locate(region, 'b', 2 * sector - 5) == sector);
+
+  compactFully(region);
+  CHECK(locate(region, 'a', sector) == 0);
+  CHECK(locate(region, 'c', sector / 2) == 3 * sector);
+  CHECK(region.largestGap() == region.freeBytes());
+  CHECK(region.freeBytes() == 12 * sector);
+  CHECK(hostFlashErrors == 0);
+  CHECK(savedTouches == 0);
+}
+
+// Power lost part way through a move: the saved directory still names
+// the source, which is intact, and compaction starts the move again
+static void testRestoreAfterInterruptedMove() {
+  static Region region;
+  const uint32_t sector = REGION_SECTOR_BYTES;
+  resetFlash(region);
+
+  CHECK(store(region, 'x', 3 * sector));
+  CHECK(store(region, 'a', 3 * sector - 1));
+  CHECK(store(region, 'b', 100));
+  CHECK(removeSample(region, 'x'));
+  CHECK(!region.compactStep());
+  CHECK(!region.compactStep());
+
+  restart(region);
+  CHECK(locate(region, 'a', 3 * sector - 1) == 3 * sector);
+  CHECK(locate(region, 'b', 100) == 6 * sector);
+  for (int step = 0; step < 100; step++) CHECK(!region.verifyStep(1000));
+  CHECK(region.damagedCount() == 0);
+
+  compactFully(region);
+  CHECK(locate(region, 'a', 3 * sector - 1) == 0);
+  CHECK(locate(region, 'b', 100) == 3 * sector);
+
+  restart(region);
+  CHECK(locate(region, 'a', 3 * sector - 1) == 0);
+  CHECK(locate(region, 'b', 100) == 3 * sector);
+  CHECK(hostFlashErrors == 0);
+  CHECK(savedTouches == 0);
+}
+
+// A flipped bit is found after boot and the sample dropped
+static void testVerifyDropsDamaged() {
+  static Region region;
+  resetFlash(region);
+
+  CHECK(store(region, 'a', 5000));
+  CHECK(store(region, 'b', 9000));
+  hostFlash[locate(region, 'b', 9000) + 4321] ^= 0x10;
+
+  restart(region);
+  bool dropped = false;
+  for (int step = 0; step < 100 && !dropped; step++) {
+    dropped = region.verifyStep(1024);
+  }
+  CHECK(dropped);
+  CHECK(region.damagedCount() == 1);
+  CHECK(strcmp(region.lastDamaged(), "/b") == 0);
+  CHECK(locate(region, 'b', 9000) == -1);
+  CHECK(locate(region, 'a', 5000) == 0);
+  CHECK(region.sampleCount() == 1);
+}
+
+// Sectors erased ahead of the writes aren't erased again under them
+static void testEraseAhead() {
+  static Region region;
+  const uint32_t sector = REGION_SECTOR_BYTES;
+  resetFlash(region);
+
+  CHECK(region.create("/a", 2 * sector + 10));
+  CHECK(!region.erasedFor(1));
+  uint32_t erases = hostFlashErases;
+  CHECK(region.eraseAhead());
+  CHECK(region.erasedFor(sector));
+  CHECK(!region.erasedFor(sector + 1));
+  CHECK(region.eraseAhead());
+  CHECK(region.eraseAhead());
+  CHECK(!region.eraseAhead());
+  CHECK(region.erasedFor(3 * sector));
+  CHECK(hostFlashErases == erases + 3);
+
+  uint8_t piece[256];
+  for (uint32_t at = 0; at < 2 * sector + 10; at += sizeof(piece)) {
+    uint32_t length = min((uint32_t)sizeof(piece), 2 * sector + 10 - at);
+    for (uint32_t i = 0; i < length; i++) piece[i] = patternByte('a', at + i);
+    region.write(piece, length);
+  }
+  CHECK(region.finish());
+  CHECK(hostFlashErases == erases + 3);
+  CHECK(locate(region, 'a', 2 * sector + 10) == 0);
+  CHECK(hostFlashErrors == 0);
+}
+
+int main() {
+  hostFlashTouched = watchSaved;
+  testFirstFit();
+  testCompaction();
+  testRestoreAfterInterruptedMove();
+  testVerifyDropsDamaged();
+  testEraseAhead();
+
+  if (failures > 0) {
+    printf("sample_region_test: %d failures\n", failures);
+    return 1;
+  }
+  printf("sample_region_test: ok\n");
+  return 0;
+}
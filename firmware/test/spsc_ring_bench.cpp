@@ -0,0 +1,78 @@
+/**
+ * SPSC Ring Benchmark
+ * Times reading a 32-frame block out of a 1024-sample stream ring three
+ * ways: wrapping with a modulo, wrapping with a mask, and mixing straight
+ * out of SpscRing's spans. Host timings only show the relative cost; the
+ * firmware's "b" command reports cycles per frame on the board.
+ */
+
+#include <chrono>
+
+#include "spsc_ring.h"
+
+#define BENCH_RING_SAMPLES 1024
+#define BENCH_BLOCK_FRAMES 32
+#define BENCH_BLOCKS 2000000
+
+static int16_t ring[BENCH_RING_SAMPLES];
+static int32_t mix[BENCH_BLOCK_FRAMES];
+
+typedef std::chrono::steady_clock Clock;
+
+static void report(const char* name, Clock::time_point start) {
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                  .count();
+  printf("%-7s %.2f ns/frame\n", name,
+         ns / ((double)BENCH_BLOCKS * BENCH_BLOCK_FRAMES));
+}
+
+int main() {
+  for (int i = 0; i < BENCH_RING_SAMPLES; i++) ring[i] = i * 37;
+
+  // Read through a volatile so the compiler can't turn % into a mask
+  volatile uint32_t ringSize = BENCH_RING_SAMPLES;
+  uint32_t size = ringSize;
+
+  uint32_t read = 1000;
+  Clock::time_point start = Clock::now();
+  for (int block = 0; block < BENCH_BLOCKS; block++) {
+    for (int i = 0; i < BENCH_BLOCK_FRAMES; i++) {
+      mix[i] += (ring[read] * 20000) >> 15;
+      read = (read + 1) % size;
+    }
+  }
+  report("modulo", start);
+
+  read = 1000;
+  start = Clock::now();
+  for (int block = 0; block < BENCH_BLOCKS; block++) {
+    for (int i = 0; i < BENCH_BLOCK_FRAMES; i++) {
+      mix[i] += (ring[read] * 20000) >> 15;
+      read = (read + 1) & (BENCH_RING_SAMPLES - 1);
+    }
+  }
+  report("mask", start);
+
+  // Start near the end of the array so blocks regularly split in two
+  SpscRing<int16_t, BENCH_RING_SAMPLES> spsc(ring);
+  spsc.commitWrite(1000);
+  spsc.commitRead(1000);
+  start = Clock::now();
+  for (int block = 0; block < BENCH_BLOCKS; block++) {
+    spsc.commitWrite(BENCH_BLOCK_FRAMES);
+    RingSpan<const int16_t> spans[2];
+    int count = spsc.readSpans(spans, BENCH_BLOCK_FRAMES);
+    int32_t* out = mix;
+    for (int s = 0; s < count; s++) {
+      for (uint32_t i = 0; i < spans[s].count; i++) {
+        *out++ += (spans[s].data[i] * 20000) >> 15;
+      }
+      spsc.commitRead(spans[s].count);
+    }
+  }
+  report("spans", start);
+
+  // Keep the mix live so none of the loops are optimised away
+  printf("(checksum %d)\n", (int)mix[3]);
+  return 0;
+}
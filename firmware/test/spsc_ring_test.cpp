@@ -0,0 +1,127 @@
+/**
+ * SPSC Ring Tests
+ * Checks SpscRing's single-item and span interfaces against a reference
+ * count, including the wrap of its free-running 32-bit positions.
+ */
+
+#include "spsc_ring.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                     \
+  do {                                                       \
+    if (!(condition)) {                                      \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+             #condition);                                    \
+      failures++;                                            \
+    }                                                        \
+  } while (0)
+
+// Fill to capacity, drain part way, then read across the wrap
+static void testPushPopAndSpans() {
+  int16_t storage[8];
+  SpscRing<int16_t, 8> ring(storage);
+  CHECK(ring.empty());
+  CHECK(ring.space() == 8);
+
+  for (int i = 0; i < 8; i++) CHECK(ring.push(i));
+  CHECK(!ring.push(99));
+  CHECK(ring.size() == 8);
+
+  int16_t item = 0;
+  for (int i = 0; i < 5; i++) {
+    CHECK(ring.pop(item));
+    CHECK(item == i);
+  }
+
+  // Free space runs from the start of the array up to the oldest item
+  RingSpan<int16_t> slots[2] = {};
+  CHECK(ring.writeSpans(slots) == 1);
+  CHECK(slots[0].data == storage);
+  CHECK(slots[0].count == 5);
+  for (int i = 0; i < 3; i++) slots[0].data[i] = 100 + i;
+  ring.commitWrite(3);
+
+  // Queued items wrap: three at the end of the array, three at the start
+  RingSpan<const int16_t> queued[2] = {};
+  CHECK(ring.readSpans(queued) == 2);
+  CHECK(queued[0].count == 3 && queued[0].data[0] == 5);
+  CHECK(queued[1].count == 3 && queued[1].data[0] == 100);
+
+  CHECK(ring.readSpans(queued, 2) == 1);
+  CHECK(queued[0].count == 2);
+  CHECK(ring.readSpans(queued, 4) == 2);
+  CHECK(queued[0].count == 3 && queued[1].count == 1);
+
+  ring.commitRead(6);
+  CHECK(ring.empty());
+  CHECK(ring.readSpans(queued) == 0);
+}
+
+// Positions are free-running, so they must survive wrapping past 2^32
+static void testPositionWrap() {
+  int16_t storage[8];
+  SpscRing<int16_t, 8> ring(storage);
+  ring.commitWrite(0xFFFFFFF0u);
+  ring.commitRead(0xFFFFFFF0u);
+  CHECK(ring.empty());
+
+  for (int i = 0; i < 64; i++) {
+    CHECK(ring.push(i));
+    CHECK(ring.push(i + 1000));
+    int16_t item = 0;
+    CHECK(ring.pop(item) && item == i);
+    CHECK(ring.pop(item) && item == i + 1000);
+    CHECK(ring.empty() && ring.space() == 8);
+  }
+}
+
+// Random-sized bulk writes and reads must deliver every item in order
+static void testRandomBulkTraffic() {
+  static int16_t storage[1024];
+  SpscRing<int16_t, 1024> ring(storage);
+  uint32_t seed = 1;
+  uint32_t written = 0;
+  uint32_t read = 0;
+
+  for (int pass = 0; pass < 200000; pass++) {
+    seed = seed * 1103515245 + 12345;
+    RingSpan<int16_t> slots[2] = {};
+    int spans = ring.writeSpans(slots, (seed >> 16) % 300);
+    uint32_t filled = 0;
+    for (int s = 0; s < spans; s++) {
+      for (uint32_t i = 0; i < slots[s].count; i++) {
+        slots[s].data[i] = (int16_t)written++;
+      }
+      filled += slots[s].count;
+    }
+    ring.commitWrite(filled);
+
+    seed = seed * 1103515245 + 12345;
+    RingSpan<const int16_t> queued[2] = {};
+    spans = ring.readSpans(queued, (seed >> 16) % 300);
+    for (int s = 0; s < spans; s++) {
+      for (uint32_t i = 0; i < queued[s].count; i++) {
+        if (queued[s].data[i] != (int16_t)read++) {
+          CHECK(!"items out of order");
+          return;
+        }
+      }
+      ring.commitRead(queued[s].count);
+    }
+    CHECK(ring.size() == written - read);
+  }
+}
+
+int main() {
+  testPushPopAndSpans();
+  testPositionWrap();
+  testRandomBulkTraffic();
+
+  if (failures > 0) {
+    printf("spsc_ring_test: %d failures\n", failures);
+    return 1;
+  }
+  printf("spsc_ring_test: ok\n");
+  return 0;
+}